@@ -244,6 +244,7 @@ static const char *use_uuid = (const char *)UUID_FBS;
 static int use_uuid_len = sizeof(UUID_FBS);
 static int use_conn=1;
 static int use_path=1;
+static int use_srm=1;
 static int timeout = 20; /* default accept/reject timeout of 20 seconds */
 
 
@@ -270,6 +271,9 @@ static int cli_connect_uuid(const char *uuid, int uuid_len)
 		if (!use_path) {
 			cli->quirks &= ~OBEXFTP_SPLIT_SETPATH;
 		}
+		if (!use_srm) {
+			cli->quirks &= ~OBEXFTP_SRM;
+		}
 		cli->accept_timeout=timeout;
 	}
 
@@ -445,6 +449,9 @@ int main(int argc, char *argv[])
 	int most_recent_cmd = 0;
 	char *output_file = NULL;
 	char *move_src = NULL;
+	char *copy_src = NULL;
+	char *chmod_mode = NULL;
+	uint32_t chmod_perms = 0;
 	int ret = 0;
 
 	/* preset mode of operation depending on our name */
@@ -495,6 +502,7 @@ int main(int argc, char *argv[])
 			{"uuid",	optional_argument, NULL, 'U'},
 			{"noconn",	no_argument, NULL, 'H'},
 			{"nopath",	no_argument, NULL, 'S'},
+			{"nosrm",	no_argument, NULL, 'R'},
 			{"timeout",	required_argument, NULL, 'T'},
 			{"list",	optional_argument, NULL, 'l'},
 			{"chdir",	required_argument, NULL, 'c'},
@@ -508,6 +516,8 @@ int main(int argc, char *argv[])
 			{"probe",	no_argument, NULL, 'Y'},
 			{"info",	no_argument, NULL, 'x'},
 			{"move",	required_argument, NULL, 'm'},
+			{"copy",	required_argument, NULL, 'K'},
+			{"chmod",	required_argument, NULL, 'A'},
 			{"verbose",	no_argument, NULL, 'v'},
 			{"version",	no_argument, NULL, 'V'},
 			{"help",	no_argument, NULL, 'h'},
@@ -515,7 +525,7 @@ int main(int argc, char *argv[])
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long (argc, argv, "-ib::B:d:u::t:n:U::HST:L::l::c:C:f:o:g:G:p:k:XYxm:VvhN:FP",
+		c = getopt_long (argc, argv, "-ib::B:d:u::t:n:U::HSRT:L::l::c:C:f:o:g:G:p:k:XYxm:K:A:VvhN:FP",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -622,6 +632,10 @@ int main(int argc, char *argv[])
 			use_path=0;
 			break;
 
+		case 'R':
+			use_srm=0;
+			break;
+
 		case 'T':
 			timeout = atoi(optarg);
 			if (timeout < 0) {
@@ -639,12 +653,15 @@ int main(int argc, char *argv[])
 			if (cli_connect() >= 0) {
 				/* List folder */
 				stat_entry_t *ent;
+				char name[sizeof(ent->name) * 2];
 				void *dir = obexftp_opendir(cli, optarg);
 				while ((ent = obexftp_readdir(dir)) != NULL) {
 					stat_entry_t *st;
 					st = obexftp_stat(cli, ent->name);
 					if (!st) continue;
-					printf("%d %s%s\n", st->size, ent->name,
+					if (obexftp_stat_localname(ent, name, sizeof(name)) < 0)
+						continue;
+					printf("%d %s%s\n", st->size, name,
 						ent->mode&S_IFDIR?"/":"");
 				}
 				obexftp_closedir(dir);
@@ -758,12 +775,62 @@ int main(int argc, char *argv[])
 				break;
 			}
 			if (cli_connect() >= 0) {
-				/* Rename a file */
-				ret = obexftp_rename(cli, move_src, optarg);
+				/* Rename a file, the Siemens way if ACTION fails */
+				ret = obexftp_move(cli, move_src, optarg);
+				if (ret < 0)
+					ret = obexftp_rename(cli, move_src, optarg);
 			}
 			move_src = NULL;
 			break;
 
+		case 'K':
+			most_recent_cmd = c;
+
+			if (copy_src == NULL) {
+				copy_src = optarg;
+				break;
+			}
+			if (cli_connect() >= 0) {
+				/* Copy a file on the server */
+				ret = obexftp_copy(cli, copy_src, optarg);
+			}
+			copy_src = NULL;
+			break;
+
+		case 'A':
+			most_recent_cmd = c;
+
+			if (chmod_mode == NULL) {
+				/* Octal mode like chmod, r and w of user, group and other */
+				char *end;
+				long mode = strtol(optarg, &end, 8);
+				int shift;
+
+				chmod_mode = optarg;
+				if (*optarg < '0' || *optarg > '7' || *end != '\0' || mode > 0777) {
+					fprintf(stderr, "Invalid mode %s, use octal 0 to 777.\n", optarg);
+					chmod_perms = (uint32_t) -1;
+					break;
+				}
+				chmod_perms = 0;
+				for (shift = 0; shift < 3; shift++) {
+					int bits = (mode >> (3 * shift)) & 07;
+					uint32_t p = 0;
+
+					if (bits & 04)
+						p |= OBEXFTP_PERM_READ;
+					if (bits & 02)
+						p |= OBEXFTP_PERM_WRITE | OBEXFTP_PERM_DELETE;
+					chmod_perms |= p << (8 * shift);
+				}
+				break;
+			}
+			if (chmod_perms == (uint32_t) -1)
+				ret = -EINVAL;
+			else if (cli_connect() >= 0)
+				ret = obexftp_setperm(cli, optarg, chmod_perms);
+			break;
+
 		case 'v':
 			verbose++;
 			break;
@@ -778,6 +845,7 @@ int main(int argc, char *argv[])
 			printf("Usage: %s [ -i | -b <dev> [-B <chan>] | -U <intf> | -t <dev> | -N <host> ]\n"
 				"[-c <dir> ...] [-C <dir> ] [-l [<dir>]]\n"
 				"[-g <file> ...] [-p <files> ...] [-k <files> ...] [-x] [-m <src> <dest> ...]\n"
+				"[-K <src> <dest> ...] [-A <mode> <files> ...]\n"
 				"Transfer files from/to Mobile Equipment.\n"
 				"Copyright (c) 2002-2004 Christian W. Zuckschwerdt\n"
 				"\n"
@@ -795,6 +863,7 @@ int main(int argc, char *argv[])
 				" -U, --uuid                  use given uuid (none, FBS, IRMC, S45, SHARP)\n"
 				" -H, --noconn                suppress connection ids (no conn header)\n"
 				" -S, --nopath                dont use setpaths (use path as filename)\n"
+				" -R, --nosrm                 dont ask for single response mode\n"
 				" -T, --timeout <seconds>     timeout transfer if no accept/reject received\n\n"
 				" -c, --chdir <DIR>           chdir\n"
 				" -C, --mkdir <DIR>           mkdir and chdir\n"
@@ -808,7 +877,9 @@ int main(int argc, char *argv[])
 				" -X, --capability            retrieve capability object\n"
 				" -Y, --probe                 probe and report device characteristics\n"
 				" -x, --info                  retrieve infos (Siemens)\n"
-				" -m, --move <SRC> <DEST>     move files (Siemens)\n\n"
+				" -m, --move <SRC> <DEST>     move files\n"
+				" -K, --copy <SRC> <DEST>     copy files on the server\n"
+				" -A, --chmod <MODE> <FILES>  set permissions, e.g. 644\n\n"
 				" -v, --verbose               verbose messages\n"
 				" -V, --version               print version info\n"
 				" -h, --help, --usage         this help text\n"
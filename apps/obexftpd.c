@@ -34,8 +34,10 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #ifdef _WIN32
@@ -51,9 +53,35 @@
 #define lstat stat
 #else
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_FGETXATTR
+#include <sys/xattr.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_SELECT_H)
+#include <sys/select.h>
 #endif
 
 /* just until there is a server layer in obexftp */
@@ -63,28 +91,403 @@
 #include <obexftp/object.h>
 #include <common.h>
 
+#include "sha256.h"
+
 /* define this to "", "\r\n" or "\n" */
 #define EOLCHARS "\n"
 
 /* Application defined headers */
 #define HDR_CREATOR  0xcf	/* so we don't require OpenOBEX 1.3 */
 
-#define WORK_PATH_MAX		128
-#define CUR_DIR				"./"
+/* sessions handled per event loop wakeup */
+#define MAX_EVENTS		32
+/* directory fds kept open per session */
+#define DIR_CACHE_SIZE		8
+/* bytes handed to OpenOBEX per OBEX_EV_STREAMEMPTY from a mapped file */
+#define MMAP_CHUNK		65536
+/* and about as much of a folder listing */
+#define LIST_CHUNK		4096
+/* uploads go to temp files named like this first */
+#define PUT_TEMP_PREFIX		".obexftpd-"
+/* folder listings cached, larger ones aren't */
+#define LIST_CACHE_SIZE		32
+#define LIST_CACHE_MAX_DOC	(1 << 20)
+/* body chunks of a PUT written behind at most */
+#define PUT_MAX_INFLIGHT	8
+/* log lines queued for the log thread, a power of 2, and their length */
+#define LOG_RING_SIZE		1024
+#define LOG_LINE		256
+/* bytes a session may send per scheduling round by default */
+#define SCHED_QUANTUM		16384
+/* ms a failing listener isn't watched, doubling up to the max */
+#define LISTEN_BACKOFF_MIN	100
+#define LISTEN_BACKOFF_MAX	5000
+/* failures in a row before it is set up anew */
+#define LISTEN_MAX_ERRORS	8
+/* ms a group commit gathers uploads by default */
+#define SYNC_INTERVAL		50
+/* bytes of a metrics request read at most */
+#define METRICS_REQUEST_MAX	8192
 
 
 static char *device = NULL;
 static int channel = 10; /* OBEX_PUSH_HANDLE */
-
-static char init_work_path[WORK_PATH_MAX];
+static int use_srm = 1; /* answer single response mode requests */
+static int use_mmap = 1; /* map files instead of reading them, INET only */
+static int io_threads = 2; /* file I/O workers, 0 does it inline */
+static long session_rate = 0; /* bytes per second of each session, 0 is unlimited */
+static long total_rate = 0; /* and of all of them */
+static int workers = 0; /* processes sharing the TCP port */
+static int worker_index = -1; /* which one this is */
+static long accept_rate = 0; /* new connections per second, 0 is unlimited */
+enum sync_mode { SYNC_NONE, SYNC_FILE, SYNC_GROUP };
+static enum sync_mode sync_mode = SYNC_NONE; /* how uploads are flushed to disk */
+static int sync_interval = SYNC_INTERVAL; /* ms a group commit gathers uploads */
 
 volatile int finished = 0;
-volatile int success = 0;
-volatile int obexftpd_reset = 0;
 
-uint32_t connection_id = 0;
+static uint32_t next_connection_id = 0;
+
+struct token_bucket {
+	long		rate;		/* bytes per second, 0 is unlimited */
+	long		burst;
+	long		tokens;
+	long long	stamp;		/* ms of the last refill */
+};
+
+struct dir_cache_entry {
+	char		*path;
+	int		fd;
+	unsigned int	used;
+};
+
+/* state of one accepted connection */
+struct obexftpd_session {
+	struct obexftpd_session	*next;
+	obex_t		*handle;
+	int		fd;		/* transport fd, watched by the event loop */
+	int		own_fd;		/* accepted by us, OpenOBEX won't close it */
+	void		(*input)(struct obexftpd_session *session); /* for other fds */
+	struct rawdata_stream *http_reply; /* metrics connections: the reply, */
+	unsigned int	http_sent;	/* sent up to here */
+	int		http_read;	/* request bytes read */
+	int		http_eol;	/* the last one ended a line */
+	int		finished;	/* link is down, reap after input handling */
+	int		sending;	/* OpenOBEX has data out, watched for room */
+	int		committing;	/* its response waits for a group commit */
+	struct obexftpd_session	*run_next; /* run queue of the scheduler */
+	int		queued;
+	int		paused;		/* not watched while queued */
+	long		deficit;	/* bytes it may send this round */
+	long		last_cost;	/* bytes the last packet took */
+	long		sched_bytes;	/* bytes moved by the packet handled */
+	struct token_bucket bucket;
+	long long	req_start;	/* us, when the request began */
+	long long	list_build_us;	/* spent reading the listed directory */
+	int		success;
+	uint32_t	connection_id;
+	char		*put_name;	/* name of the PUT in progress */
+	int		put_fd;		/* its body goes to this temp file */
+	char		*put_tmp;
+	int		put_error;	/* errno that failed the PUT */
+	off_t		put_offset;	/* where the next write goes */
+	struct sha256_ctx put_hash;	/* of the body so far, with --dedup */
+	int		get_fd;		/* file streamed by the GET in progress */
+	struct rawdata_stream *list_data; /* or the listing streamed, */
+	DIR		*list_dir;	/* of this directory */
+	struct stat	list_stat;
+	int		list_flushed;	/* list_data was handed to OpenOBEX */
+	struct rawdata_stream *list_build; /* whole listing, for the cache */
+	int		list_slot;
+	unsigned int	list_gen;
+	struct listing_doc *list_doc;	/* or a cached listing is sent */
+	unsigned int	list_pos;
+	const uint8_t	*get_map;	/* or its mapping */
+	size_t		get_size;
+	size_t		get_pos;
+	volatile sig_atomic_t get_truncated; /* the mapped file shrank */
+	uint8_t		*stream_chunk;	/* STREAM_CHUNK bytes, once needed */
+	uint8_t		*stream_next;	/* and as much read ahead into this */
+	off_t		read_offset;
+	ssize_t		read_len;
+	int		read_error;
+	int		read_ready;
+	int		io_pending;	/* jobs queued to the I/O workers */
+	char		*cwd;		/* relative to the root */
+	int		dirfd;		/* of cwd, owned by the cache */
+	struct dir_cache_entry dirs[DIR_CACHE_SIZE];
+	unsigned int	dir_clock;
+};
+
+static struct obexftpd_session *sessions = NULL;
+static struct obexftpd_session *services = NULL; /* no OBEX, just an fd */
+static int session_count = 0;
+
+//BEGIN of logging
+/*
+ * Messages below log_level are dropped before they are formatted. The
+ * rest go to a ring of fixed size lines a background thread writes to
+ * stderr, so the protocol loop never blocks on a slow terminal. The
+ * ring takes lines from any thread without locking; when it is full
+ * lines are dropped and counted. The thread sleeps while the ring is
+ * empty and the first line after that wakes it. Before log_start() and after
+ * log_stop() lines are written right away.
+ */
+enum log_level { LVL_ERROR, LVL_WARN, LVL_INFO, LVL_DEBUG };
+
+static volatile int log_level = LVL_WARN;
+static const char *log_levels[] = { "error", "warning", "info", "debug" };
+
+#define LOG(level, ...)	do { if ((level) <= log_level) log_write(__VA_ARGS__); } while (0)
+#define log_error(...)	LOG(LVL_ERROR, __VA_ARGS__)
+#define log_warn(...)	LOG(LVL_WARN, __VA_ARGS__)
+#define log_info(...)	LOG(LVL_INFO, __VA_ARGS__)
+#define log_debug(...)	LOG(LVL_DEBUG, __VA_ARGS__)
+/* like log_errno(LVL_ERROR, ) */
+#define log_errno(level, what)	LOG(level, "%s: %s", what, strerror(errno))
+
+#if defined(HAVE_PTHREAD_H) && defined(__ATOMIC_ACQUIRE)
+#define LOG_RING
+#endif
+
+#ifdef LOG_RING
+struct log_line {
+	unsigned int	seq;	/* slot is free for the writer at seq, full at seq + 1 */
+	char		text[LOG_LINE];
+};
+
+static struct log_line log_ring[LOG_RING_SIZE];
+static unsigned int log_head = 0;	/* next slot to fill */
+static unsigned int log_tail = 0;	/* next slot to write out, thread only */
+static unsigned int log_dropped = 0;
+static int log_running = 0;
+static int log_idle = 0;	/* the thread waits for log_cond */
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/* whether the next slot to write out is full */
+static int log_pending(void)
+{
+	struct log_line *line = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+
+	return __atomic_load_n(&line->seq, __ATOMIC_SEQ_CST) == log_tail + 1;
+}
+
+/* one slot to stderr, returns 0 if it is still empty */
+static int log_drain_one(void)
+{
+	struct log_line *line = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+	unsigned int dropped;
+
+	if (__atomic_load_n(&line->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+		return 0;
+	fputs(line->text, stderr);
+	__atomic_store_n(&line->seq, log_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	log_tail++;
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(stderr, "(%u log messages dropped)\n", dropped);
+	return 1;
+}
+
+static void *log_drain(void *UNUSED(arg))
+{
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		if (log_drain_one())
+			continue;
+		fflush(stderr);
+
+		pthread_mutex_lock(&log_lock);
+		__atomic_store_n(&log_idle, 1, __ATOMIC_SEQ_CST);
+		/* lines published before log_idle was set came without a wakeup */
+		while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) && !log_pending())
+			pthread_cond_wait(&log_cond, &log_lock);
+		__atomic_store_n(&log_idle, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&log_lock);
+	}
+	while (log_drain_one())
+		;
+	fflush(stderr);
+	return NULL;
+}
+#endif
+
+static void log_write(const char *format, ...)
+{
+	va_list ap;
+#ifdef LOG_RING
+	struct log_line *line;
+	unsigned int pos, seq;
+	int len;
+
+	if (__atomic_load_n(&log_running, __ATOMIC_RELAXED)) {
+		pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		for (;;) {
+			line = &log_ring[pos & (LOG_RING_SIZE - 1)];
+			seq = __atomic_load_n(&line->seq, __ATOMIC_ACQUIRE);
+			if (seq == pos) {
+				if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if ((int) (seq - pos) < 0) {
+				/* full */
+				__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+				return;
+			} else
+				pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+
+		va_start(ap, format);
+		len = vsnprintf(line->text, LOG_LINE - 1, format, ap);
+		va_end(ap);
+		if (len < 0)
+			len = 0;
+		if (len > LOG_LINE - 2)
+			len = LOG_LINE - 2;
+		line->text[len] = '\n';
+		line->text[len + 1] = '\0';
+		__atomic_store_n(&line->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+		/* the ring was empty, wake the thread */
+		if (__atomic_load_n(&log_idle, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&log_lock);
+			pthread_cond_signal(&log_cond);
+			pthread_mutex_unlock(&log_lock);
+		}
+		return;
+	}
+#endif
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void log_stop(void);
+
+static void log_start(void)
+{
+#ifdef LOG_RING
+	static int registered = 0;
+	unsigned int i;
+
+	if (log_running)
+		return;
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = log_head + i;
+	log_tail = log_head;
+	log_running = 1;
+	if (pthread_create(&log_thread, NULL, log_drain, NULL) != 0) {
+		log_running = 0;
+		return;
+	}
+	/* flush what is queued when exit() is called */
+	if (!registered) {
+		registered = 1;
+		atexit(log_stop);
+	}
+#endif
+}
+
+static void log_stop(void)
+{
+#ifdef LOG_RING
+	if (!log_running)
+		return;
+	pthread_mutex_lock(&log_lock);
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(log_thread, NULL);
+#endif
+}
+
+#ifndef _WIN32
+/* SIGUSR1 logs more, SIGUSR2 less */
+static void log_level_signal(int sig)
+{
+	if (sig == SIGUSR1 && log_level < LVL_DEBUG)
+		log_level++;
+	else if (sig == SIGUSR2 && log_level > LVL_ERROR)
+		log_level--;
+}
+#endif
+//END of logging
+
+//BEGIN of metrics
+/*
+ * Counters and latency histograms, updated from the main thread only
+ * and served in Prometheus text format by the metrics endpoint.
+ */
+enum metrics_op { OP_CONNECT, OP_DISCONNECT, OP_PUT, OP_GET, OP_SETPATH, OP_ACTION, OP_OTHER, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "connect", "disconnect", "put", "get", "setpath", "action", "other" };
+
+/* upper bounds of the buckets in us, one more bucket for +Inf */
+#define HIST_BUCKETS	10
+static const long long hist_bounds[HIST_BUCKETS] = {
+	500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000
+};
+
+struct histogram {
+	unsigned long		count[HIST_BUCKETS + 1];
+	unsigned long long	sum_us;
+};
+
+static struct {
+	unsigned long		accepted;
+	unsigned long		requests[OP_COUNT];
+	unsigned long		aborted[OP_COUNT];
+	unsigned long		responses[0x80];
+	unsigned long long	bytes_in;
+	unsigned long long	bytes_out;
+	unsigned long		listing_cache_hits;
+	unsigned long		listing_cache_misses;
+	struct histogram	latency[OP_COUNT];
+	struct histogram	listing_build;
+	struct histogram	io_wait;
+	struct histogram	io_job;
+} metrics;
+
+static long long now_us(void)
+{
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void hist_observe(struct histogram *hist, long long us)
+{
+	int i;
+
+	if (us < 0)
+		us = 0;
+	for (i = 0; i < HIST_BUCKETS && us > hist_bounds[i]; i++)
+		;
+	hist->count[i]++;
+	hist->sum_us += us;
+}
 
-int verbose = 0;
+static enum metrics_op metrics_op(int cmd)
+{
+	switch (cmd) {
+	case OBEX_CMD_CONNECT:		return OP_CONNECT;
+	case OBEX_CMD_DISCONNECT:	return OP_DISCONNECT;
+	case OBEX_CMD_PUT:		return OP_PUT;
+	case OBEX_CMD_GET:		return OP_GET;
+	case OBEX_CMD_SETPATH:		return OP_SETPATH;
+	case OBEX_CMD_ACTION:		return OP_ACTION;
+	default:			return OP_OTHER;
+	}
+}
+//END of metrics
 
 // this whole thing needs a review:
 static int parsehostport(const char *name, char **host, int *port) {
@@ -121,6 +524,8 @@ struct rawdata_stream {
 	unsigned int	block_size;
 	unsigned int 	size;
 	unsigned int 	max_size;
+	long		day;		/* of date, see format_time() */
+	char		date[sizeof("yyyymmddT")];
 };
 
 static struct rawdata_stream* INIT_RAWDATA_STREAM(unsigned int size)
@@ -138,41 +543,85 @@ static struct rawdata_stream* INIT_RAWDATA_STREAM(unsigned int size)
 		return NULL;
 	}
 
-       	memset(stream->data,0,size);
+       	stream->data[0] = '\0';
        	stream->size = 0;
        	stream->block_size = size;
        	stream->max_size = size;
+       	stream->day = -1;
 
 	return stream;
 }
 
-static int ADD_RAWDATA_STREAM_DATA(struct rawdata_stream *stream, const char *data)
+/* make room for size more bytes plus the terminating NUL */
+static int RESERVE_RAWDATA_STREAM(struct rawdata_stream *stream, unsigned int size)
 {
 	char   		*databuf;
-	unsigned int 	size;
+	unsigned int	max_size;
 
-	if (data == NULL) return 0;
-	size = strlen(data);
-	if (size == 0) return 0;
-	if ((size + stream->size) >= stream->max_size)
+	if ((size + stream->size) < stream->max_size)
+		return 0;
+
+	/* grow geometrically, appends stay linear in total */
+	max_size = stream->max_size;
+	while((size + stream->size) >= max_size)
 	{
-		while((size + stream->size) >= stream->max_size)
-		{
-			stream->max_size += stream->block_size;
-		}
-		databuf = realloc(stream->data, stream->max_size);
-		if (NULL == databuf)
-		{
-			fprintf(stderr, "realloc() failed\n");
-			return -1; 
-		}
-		stream->data = databuf;
+		max_size += max_size > stream->block_size ? max_size : stream->block_size;
 	}
-	strcat(stream->data, data);
+	databuf = realloc(stream->data, max_size);
+	if (NULL == databuf)
+	{
+		log_error("realloc() failed");
+		return -1; 
+	}
+	stream->data = databuf;
+	stream->max_size = max_size;
+	return 0;
+}
+
+static int ADD_RAWDATA_STREAM_BYTES(struct rawdata_stream *stream, const char *data, unsigned int size)
+{
+	if (size == 0) return 0;
+	if (RESERVE_RAWDATA_STREAM(stream, size) < 0)
+		return -1;
+	memcpy(stream->data + stream->size, data, size);
 	stream->size += size;
+	stream->data[stream->size] = '\0';
 	return size;
 }
 
+static int ADD_RAWDATA_STREAM_DATA(struct rawdata_stream *stream, const char *data)
+{
+	if (data == NULL) return 0;
+	return ADD_RAWDATA_STREAM_BYTES(stream, data, strlen(data));
+}
+
+/* append data with the XML special characters escaped */
+static int ADD_RAWDATA_STREAM_ESCAPED(struct rawdata_stream *stream, const char *data)
+{
+	const char *p, *entity;
+	unsigned int start = stream->size;
+
+	for (p = data; *p; p = data) {
+		data += strcspn(data, "&<>\"'");
+		if (0 > ADD_RAWDATA_STREAM_BYTES(stream, p, data - p))
+			return -1;
+		switch (*data) {
+		case '&':	entity = "&amp;"; break;
+		case '<':	entity = "&lt;"; break;
+		case '>':	entity = "&gt;"; break;
+		case '"':	entity = "&quot;"; break;
+		case '\'':	entity = "&apos;"; break;
+		default:	entity = NULL; break;
+		}
+		if (entity == NULL)
+			break;
+		if (0 > ADD_RAWDATA_STREAM_DATA(stream, entity))
+			return -1;
+		data++;
+	}
+	return stream->size - start;
+}
+
 static void FREE_RAWDATA_STREAM(struct rawdata_stream *stream)
 {
 	free(stream->data);
@@ -197,53 +646,106 @@ static void FREE_RAWDATA_STREAM(struct rawdata_stream *stream)
 #define FL_XML_BODY_ITEM_END(stream) \
 	ADD_RAWDATA_STREAM_DATA(stream, "/>" EOLCHARS);
 
-inline static void FL_XML_BODY_FOLDERNAME(struct rawdata_stream *stream, char *name)
+inline static void FL_XML_BODY_FOLDERNAME(struct rawdata_stream *stream, const char *name)
 {
 	ADD_RAWDATA_STREAM_DATA(stream, "folder name=\""); 
-	ADD_RAWDATA_STREAM_DATA(stream, name);		
+	ADD_RAWDATA_STREAM_ESCAPED(stream, name);
 	ADD_RAWDATA_STREAM_DATA(stream, "\" ");
 }
 
-inline static void FL_XML_BODY_FILENAME(struct rawdata_stream *stream, char *name)
+inline static void FL_XML_BODY_FILENAME(struct rawdata_stream *stream, const char *name)
 {
 	ADD_RAWDATA_STREAM_DATA(stream, "file name=\""); 
-	ADD_RAWDATA_STREAM_DATA(stream, name);		
+	ADD_RAWDATA_STREAM_ESCAPED(stream, name);
 	ADD_RAWDATA_STREAM_DATA(stream, "\" ");
 }
 
-inline static void FL_XML_BODY_SIZE(struct rawdata_stream *stream, unsigned int size)	
+inline static void FL_XML_BODY_SIZE(struct rawdata_stream *stream, unsigned long long size)
 {
-	const char format[] = "size=\"%d\" ";
-	char str_size[sizeof(format)+14];
+	char str_size[sizeof("size=\"\" ") + 20];
+	char *p = str_size + sizeof(str_size);
 
-	snprintf(str_size,sizeof(str_size), format, size);
-	ADD_RAWDATA_STREAM_DATA(stream, str_size);
+	*--p = ' ';
+	*--p = '"';
+	do {
+		*--p = '0' + size % 10;
+		size /= 10;
+	} while (size);
+	memcpy(p -= sizeof("size=\"") - 1, "size=\"", sizeof("size=\"") - 1);
+	ADD_RAWDATA_STREAM_BYTES(stream, p, str_size + sizeof(str_size) - p);
 }
 
 inline static void FL_XML_BODY_PERM(struct rawdata_stream *stream, mode_t file, mode_t dir)	
 {
-	const char format[] = "user-perm=\"%s%s%s\" ";
-	char str_perm[sizeof(format)];
+	char str_perm[sizeof("user-perm=\"RWD\" ")];
+	char *p = str_perm;
+
+	memcpy(p, "user-perm=\"", sizeof("user-perm=\"") - 1);
+	p += sizeof("user-perm=\"") - 1;
+	if (file & (S_IRUSR|S_IRGRP|S_IROTH)) *p++ = 'R';
+	if (file & (S_IWUSR|S_IWGRP|S_IWOTH)) *p++ = 'W';
+	if (dir & (S_IWUSR|S_IWGRP|S_IWOTH)) *p++ = 'D';
+	*p++ = '"';
+	*p++ = ' ';
+	ADD_RAWDATA_STREAM_BYTES(stream, str_perm, p - str_perm);
+}
+
+/*
+ * Function format_time()
+ *
+ *    Write time as "yyyymmddThhmmssZ". Only the date goes through
+ *    gmtime() and strftime(), once per day seen in a row; files in a
+ *    folder tend to share days.
+ *
+ */
+static int format_time(struct rawdata_stream *stream, char *buf, time_t time)
+{
+	long day, secs;
+	time_t midnight;
+	struct tm tm;
 
-	snprintf(str_perm,sizeof(str_perm),format,
-		 (file & (S_IRUSR|S_IRGRP|S_IROTH)? "R": ""),
-		 (file & (S_IWUSR|S_IWGRP|S_IWOTH)? "W": ""),
-		 (dir & (S_IWUSR|S_IWGRP|S_IWOTH)? "D": ""));
-	ADD_RAWDATA_STREAM_DATA(stream,str_perm);
+	day = (long) (time / 86400);
+	secs = (long) (time % 86400);
+	if (secs < 0) {
+		secs += 86400;
+		day--;
+	}
+	if (day != stream->day || stream->day < 0) {
+		midnight = (time_t) day * 86400;
+		if (gmtime_r(&midnight, &tm) == NULL ||
+		    strftime(stream->date, sizeof(stream->date), "%Y%m%dT", &tm) != sizeof(stream->date) - 1) {
+			stream->day = -1;
+			return -1;
+		}
+		stream->day = day;
+	}
+
+	memcpy(buf, stream->date, sizeof(stream->date) - 1);
+	buf += sizeof(stream->date) - 1;
+	buf[0] = '0' + secs / 36000;
+	buf[1] = '0' + secs / 3600 % 10;
+	buf[2] = '0' + secs % 3600 / 600;
+	buf[3] = '0' + secs % 600 / 60;
+	buf[4] = '0' + secs % 60 / 10;
+	buf[5] = '0' + secs % 10;
+	buf[6] = 'Z';
+	return 0;
 }
 
 inline static void FL_XML_BODY_TIME(struct rawdata_stream *stream,
                                     const char* type,
                                     time_t time)
 {
-	struct tm* tm = gmtime(&time);
 	char str_tm[sizeof("=\"yyyymmddThhmmssZ\" ")];
 
-	if (tm == NULL || stream == NULL ||
-	    strftime(str_tm,sizeof(str_tm),"=\"%Y%m%dT%H%M%SZ\" ",tm) == 0)
+	if (stream == NULL || format_time(stream, str_tm + 2, time) < 0)
 		return;
+	str_tm[0] = '=';
+	str_tm[1] = '"';
+	str_tm[sizeof(str_tm) - 3] = '"';
+	str_tm[sizeof(str_tm) - 2] = ' ';
 	ADD_RAWDATA_STREAM_DATA(stream, type);
-	ADD_RAWDATA_STREAM_DATA(stream, str_tm);
+	ADD_RAWDATA_STREAM_BYTES(stream, str_tm, sizeof(str_tm) - 1);
 }
 
 #define FL_XML_BODY_MTIME(stream,time) \
@@ -253,616 +755,3539 @@ inline static void FL_XML_BODY_TIME(struct rawdata_stream *stream,
 #define FL_XML_BODY_ATIME(stream,time) \
         FL_XML_BODY_TIME(stream,"accessed",time)
 
-//END of compositor the folder listing XML document
-
-inline static int is_type_fl(const char *type)
+/* one <file .../> or <folder .../> line */
+static void FL_XML_BODY_ITEM(struct rawdata_stream *stream, const char *name,
+			     const struct stat *statbuf, mode_t dir)
 {
-	return (type && strcmp(type, XOBEX_LISTING) == 0);
+	FL_XML_BODY_ITEM_BEGIN(stream);
+	if (0 == S_ISDIR(statbuf->st_mode)) //it is a file
+		FL_XML_BODY_FILENAME(stream, name);
+	else	//it is a directory
+		FL_XML_BODY_FOLDERNAME(stream, name);
+
+	FL_XML_BODY_SIZE(stream, statbuf->st_size);
+	FL_XML_BODY_PERM(stream, statbuf->st_mode, dir);
+	FL_XML_BODY_MTIME(stream, statbuf->st_mtime);
+	FL_XML_BODY_CTIME(stream, statbuf->st_ctime);
+	FL_XML_BODY_ATIME(stream, statbuf->st_atime);
+	FL_XML_BODY_ITEM_END(stream);
 }
 
-static void connect_server(obex_t *handle, obex_object_t *object)
-{
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hlen;
-	uint8_t *target = NULL;
-	int target_len = 0;
+//END of compositor the folder listing XML document
 
-	//printf("%s()\n", __FUNCTION__);
+//BEGIN of directory handling
+/*
+ * Names from the client are resolved below root_fd, one component at
+ * a time with O_NOFOLLOW, so neither ".." nor symlinks lead out of
+ * the served tree. Paths are kept relative to the root, "" being the
+ * root itself.
+ */
+static int root_fd = -1;
 
-	while (OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen)) {
-		switch(hi) {
-		case OBEX_HDR_TARGET:
-			if (0 < hlen)
-			{
-				if( (target = malloc(hlen))) {
-					target_len = hlen;
-					memcpy(target,hv.bs,target_len);
-				}
-			}
-			break;
-		default:	
-			printf("%s() Skipped header %02x\n", __FUNCTION__, hi);
-			break;
-		}
-	}
+static int dir_open(const char *path)
+{
+	char *p, *comp, *next;
+	int fd, dirfd;
 
-	OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
-	hv.bq4 = connection_id;
-	if(OBEX_ObjectAddHeader(handle, object, OBEX_HDR_CONNECTION,
-              		hv, sizeof(hv.bq4),
-                            OBEX_FL_FIT_ONE_PACKET) < 0 )    {
-                fprintf(stderr, "Error adding header CONNECTION\n");
-                OBEX_ObjectDelete(handle, object);
-                return;
-        }
-	if (target && target_len) {
-		hv.bs = target;
-		if(OBEX_ObjectAddHeader(handle,object,OBEX_HDR_WHO,
-					hv,target_len,OBEX_FL_FIT_ONE_PACKET) < 0 ) {
-			fprintf(stderr, "Error adding header WHO\n");
-			OBEX_ObjectDelete(handle, object);
-			return;
+	p = strdup(path);
+	if (p == NULL)
+		return -1;
+	dirfd = root_fd;
+	for (comp = p; *comp; comp = next) {
+		next = strchr(comp, '/');
+		if (next)
+			*next++ = '\0';
+		else
+			next = comp + strlen(comp);
+		fd = openat(dirfd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (dirfd != root_fd)
+			close(dirfd);
+		if (fd < 0) {
+			free(p);
+			return -1;
 		}
-		free(target);
-	} 
+		dirfd = fd;
+	}
+	free(p);
+	if (dirfd == root_fd)
+		dirfd = dup(root_fd);
+	return dirfd;
 }
 
-
-static void set_server_path(obex_t *handle, obex_object_t *object)
+/* name relative to dir, a leading slash starts at the root */
+static char *join_path(const char *dir, const char *name)
 {
-	char *name = NULL;
-	char fullname[WORK_PATH_MAX];
+	char *path, *p;
+	const char *comp;
+	size_t len;
 
-	// "Backup Level" and "Don't Create" flag in first byte
-	uint8_t setpath_nohdr_dummy = 0;
-	uint8_t *setpath_nohdr_data;
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hlen;
-
-	OBEX_ObjectGetNonHdrData(object, &setpath_nohdr_data);
-	if (NULL == setpath_nohdr_data) {
-		setpath_nohdr_data = &setpath_nohdr_dummy;
-		printf("nohdr data not found\n");
-	}
-	printf("nohdr data: %x\n", *setpath_nohdr_data);
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path == NULL)
+		return NULL;
+	if (*name == '/')
+		dir = "";
+	strcpy(path, dir);
+	p = path + strlen(path);
 
-	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
-		switch(hi)	{
-		case OBEX_HDR_NAME:
-			printf("%s() Found name\n", __FUNCTION__);
-			if (0 < hlen)
-			{
-				if( (name = malloc(hlen / 2)))	{
-					OBEX_UnicodeToChar((uint8_t*)name, hv.bs, hlen);
-					printf("name:%s\n", name);
-				}
-			}
-			else
-			{
-				if (verbose) printf("set path to root\n");
-				chdir(init_work_path);
-			}
-			break;
-			
-		default:
-			printf("%s() Skipped header %02x\n", __FUNCTION__, hi);
-		}
-	}	
-	
-	if (name)
-	{
-		if (strstr(name, "/../"))
-		{
-			OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_FORBIDDEN);
-		} else {
-		strcpy(fullname, CUR_DIR);
-		strncat(fullname, name, sizeof(fullname)-1);
-		if ((*setpath_nohdr_data & 2) == 0) {
-			if (verbose) printf("mkdir %s\n", name);
-			if (mkdir(fullname, 0755) < 0) {
-				perror("requested mkdir failed");
-			}
-		}
-		if (verbose) printf("Set path to %s\n",fullname);
-		if (chdir(fullname) < 0)
-		{
-			perror("requested chdir failed\n");
-			OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_FORBIDDEN);
-		}
+	for (comp = name; *comp; comp += len) {
+		while (*comp == '/')
+			comp++;
+		len = strcspn(comp, "/");
+		if (len == 0 || (len == 1 && comp[0] == '.'))
+			continue;
+		if (len == 2 && comp[0] == '.' && comp[1] == '.') {
+			free(path);
+			errno = EACCES;
+			return NULL;
 		}
-		free(name);
-		name = NULL;
+		if (p != path)
+			*p++ = '/';
+		memcpy(p, comp, len);
+		p += len;
 	}
+	*p = '\0';
+	return path;
 }
 
-//
-// Get the filesize in a "portable" way
-//
-static int get_filesize(const char *filename)
+/* whether a cached fd still is the directory found at its path */
+static int dir_current(const struct dir_cache_entry *entry)
 {
-	struct stat stats;
-	stat(filename, &stats);
-	if (S_ISDIR(stats.st_mode)) {
-		fprintf(stderr,"GET of directories not implemented !!!!\n");
-		return -1;
-	}
-	return (int) stats.st_size;
+	struct stat path_st, fd_st;
+
+	if (fstatat(root_fd, entry->path, &path_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    fstat(entry->fd, &fd_st) < 0)
+		return FALSE;
+	return path_st.st_dev == fd_st.st_dev && path_st.st_ino == fd_st.st_ino;
 }
 
-//
-// Read a file and alloc a buffer for it
-//
-static uint8_t* easy_readfile(const char *filename, int *file_size)
+/*
+ * Function session_dir()
+ *
+ *    Get an fd for the directory path, recently used ones are cached.
+ *    Another session, worker or a local user may have moved or
+ *    removed a directory since, so a cached fd is checked against
+ *    the path first. The cwd is checked by session_check_cwd() only.
+ *
+ */
+static int session_dir(struct obexftpd_session *session, const char *path)
 {
-	int actual;
-	int fd;
-	uint8_t *buf;
+	struct dir_cache_entry *entry, *lru = NULL;
+	int i, fd;
+
+	if (*path == '\0')
+		return root_fd;
 
-	*file_size = get_filesize(filename);
-	printf("name=%s, size=%d\n", filename, *file_size);
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		entry = &session->dirs[i];
+		if (entry->path && !strcmp(entry->path, path)) {
+			entry->used = ++session->dir_clock;
+			if (entry->fd == session->dirfd || dir_current(entry))
+				return entry->fd;
+			fd = dir_open(path);
+			if (fd < 0)
+				return -1;
+			close(entry->fd);
+			entry->fd = fd;
+			return fd;
+		}
+		if (entry->path && entry->fd == session->dirfd)
+			continue; /* in use as cwd */
+		if (lru == NULL || entry->used < lru->used)
+			lru = entry;
+	}
 
-	fd = open(filename, O_RDONLY, 0);
+	fd = dir_open(path);
+	if (fd < 0)
+		return -1;
 
-	if (fd == -1)
-	{
-		return NULL;
+	if (lru->path) {
+		close(lru->fd);
+		free(lru->path);
 	}
-	
-	buf = malloc(*file_size);
-	if(buf == NULL)
-	{
-		return NULL;
+	lru->path = strdup(path);
+	if (lru->path == NULL) {
+		close(fd);
+		lru->used = 0;
+		return -1;
 	}
+	lru->fd = fd;
+	lru->used = ++session->dir_clock;
+	return fd;
+}
 
-	actual = read(fd, buf, *file_size);
-	close(fd); 
+/* whether path is dir or below it */
+static int path_below(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
 
-	*file_size = actual;
-	return buf;
+	return !strncmp(path, dir, len) && (path[len] == '\0' || path[len] == '/');
 }
 
-static void get_server(obex_t *handle, obex_object_t *object)
+/* forget cached fds of path and everything below */
+static void session_forget_dir(struct obexftpd_session *session, const char *path)
 {
-	uint8_t *buf = NULL;
+	int i;
 
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hlen;
-	int file_size;
-
-	char *name = NULL;
-	char *type = NULL;
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		struct dir_cache_entry *entry = &session->dirs[i];
+		if (entry->path && entry->fd != session->dirfd &&
+		    path_below(entry->path, path)) {
+			close(entry->fd);
+			free(entry->path);
+			entry->path = NULL;
+			entry->used = 0;
+		}
+	}
+}
 
-	printf("%s()\n", __FUNCTION__);
+/*
+ * Function session_check_cwd()
+ *
+ *    Follow the cwd to the directory now at its path. Done before
+ *    each request, while no temp file is left in the old one.
+ *
+ */
+static void session_check_cwd(struct obexftpd_session *session)
+{
+	struct dir_cache_entry *entry;
+	int i, fd;
 
-	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
-		switch(hi)	{
-		case OBEX_HDR_NAME:
-			printf("%s() Found name\n", __FUNCTION__);
-			if( (name = malloc(hlen / 2)))	{
-				OBEX_UnicodeToChar((uint8_t*)name, hv.bs, hlen);
-				printf("name:%s\n", name);
-			}
-			break;
-			
-		case OBEX_HDR_TYPE:
-			if( (type = malloc(hlen + 1)))	{
-				strcpy(type, (char *)hv.bs);
-			}
-			printf("%s() type:%s\n", __FUNCTION__, type);
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		entry = &session->dirs[i];
+		if (entry->path == NULL || entry->fd != session->dirfd)
+			continue;
+		if (dir_current(entry))
+			return;
+		/* if it is gone for good requests fail in the old one */
+		fd = dir_open(entry->path);
+		if (fd < 0)
+			return;
+		close(entry->fd);
+		entry->fd = fd;
+		session->dirfd = fd;
+		return;
+	}
+}
 
-		case 0xbe: // user-defined inverse push
-			printf("%s() Found inverse push req\n", __FUNCTION__);
-       			printf("data:%02x\n", hv.bq1);
-			break;
-			
+static void session_free_dirs(struct obexftpd_session *session)
+{
+	int i;
 
-		case OBEX_HDR_APPARAM:
-			printf("%s() Found apparam\n", __FUNCTION__);
-       			printf("name:%d (%02x %02x ...)\n", hlen, *hv.bs, *(hv.bs+1));
-			break;
-			
-		default:
-			printf("%s() Skipped header %02x\n", __FUNCTION__, hi);
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (session->dirs[i].path) {
+			close(session->dirs[i].fd);
+			free(session->dirs[i].path);
 		}
 	}
+	free(session->cwd);
+}
 
-	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-	if (is_type_fl(type))
-	{
-		struct dirent		*dirp;
-		DIR			*dp;
-		struct stat		statdir;
-		struct stat		statbuf;
-		char			*filename;
-		struct rawdata_stream	*xmldata;
+/* fd of the directory holding the last component of path */
+static int session_parent(struct obexftpd_session *session, const char *path, const char **base)
+{
+	char *parent;
+	const char *s;
+	int fd;
 
-		xmldata = INIT_RAWDATA_STREAM(512);
-		if (NULL == xmldata)
-			goto out;
+	s = strrchr(path, '/');
+	if (s == NULL) {
+		*base = path;
+		return session_dir(session, "");
+	}
+	*base = s + 1;
+	parent = strndup(path, s - path);
+	if (parent == NULL)
+		return -1;
+	fd = session_dir(session, parent);
+	free(parent);
+	return fd;
+}
 
-		FL_XML_VERSION(xmldata);
-		FL_XML_TYPE(xmldata);
-		FL_XML_BODY_BEGIN(xmldata);
+static int session_chdir(struct obexftpd_session *session, char *path)
+{
+	int fd;
 
-		stat(CUR_DIR, &statdir);
-		dp = opendir(CUR_DIR);
-		while(NULL != dp && NULL != (dirp = readdir(dp))) 
-		{
-			if (0 == strcmp(dirp->d_name, ".") || 0 == strcmp(dirp->d_name, ".."))
-				continue;
+	fd = session_dir(session, path);
+	if (fd < 0)
+		return -1;
+	free(session->cwd);
+	session->cwd = path;
+	session->dirfd = fd;
+	return 0;
+}
+//END of directory handling
 
-			FL_XML_BODY_ITEM_BEGIN(xmldata);
+//BEGIN of folder listing cache
+/*
+ * Listings of recently listed folders are kept, keyed by device and
+ * inode. An inotify watch drops a folder's listing as soon as anything
+ * in it changes. The server's own PUT, delete and mkdir drop it right
+ * away, as their inotify events come in later. Without inotify nothing
+ * is cached.
+ */
+#define LIST_CACHE_MASK		(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+				 IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
 
-			//Adding 1 bytes due to containing '\0' 
-			filename = malloc(strlen(CUR_DIR) + strlen(dirp->d_name) + 1);
-			strcpy(filename, CUR_DIR);
-			strcat(filename, dirp->d_name);
+/* a finished listing, shared by the cache and sessions sending it */
+struct listing_doc {
+	int		refs;
+	unsigned int	size;
+	char		data[1];
+};
 
-			lstat(filename, &statbuf);
-			if (0 == S_ISDIR(statbuf.st_mode)) //it is a file
-				FL_XML_BODY_FILENAME(xmldata, dirp->d_name);				
-			else	//it is a directory
-				FL_XML_BODY_FOLDERNAME(xmldata, dirp->d_name);
-			
-			FL_XML_BODY_SIZE(xmldata, statbuf.st_size);
-			FL_XML_BODY_PERM(xmldata, statbuf.st_mode, statdir.st_mode);
-			FL_XML_BODY_MTIME(xmldata, statbuf.st_mtime);
-			FL_XML_BODY_CTIME(xmldata, statbuf.st_ctime);
-			FL_XML_BODY_ATIME(xmldata, statbuf.st_atime);
+struct listing_cache_entry {
+	dev_t		dev;
+	ino_t		ino;
+	int		wd;	/* inotify watch, -1 if unused */
+	unsigned int	gen;	/* bumped whenever the entry is dropped */
+	unsigned int	used;
+	struct listing_doc *doc; /* NULL while a listing is being built */
+};
 
-			FL_XML_BODY_ITEM_END(xmldata);
-			
-			//printf("---filename:%s\n", filename);
-			//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-			free(filename);
-			filename = NULL;
-			//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-		}
-		//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-		FL_XML_BODY_END(xmldata);
+static struct listing_cache_entry listing_cache[LIST_CACHE_SIZE];
+static unsigned int listing_clock = 0;
+static int inotify_fd = -1;
+static char *root_path = NULL;
 
-		closedir(dp);
-		printf("xml doc:%s\n", xmldata->data);
-		
-		//composite the obex obejct
-		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-		hv.bs = (uint8_t *)xmldata->data;
-		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_BODY, hv, xmldata->size, 0);
-		hv.bq4 = xmldata->size;
-		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_LENGTH, hv, sizeof(uint32_t), 0);
-		//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-		FREE_RAWDATA_STREAM(xmldata);
-		//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-	}
-	else if (name)
-	{
-		printf("%s() Got a request for %s\n", __FUNCTION__, name);
-		
-		buf = easy_readfile(name, &file_size);
-		if(buf == NULL) {
-			printf("Can't find file %s\n", name);
-			OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
-			return;
-		}
+static void listing_doc_put(struct listing_doc *doc)
+{
+	if (doc && --doc->refs == 0)
+		free(doc);
+}
 
-		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-		hv.bs = buf;
-		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_BODY, hv, file_size, 0);
-		hv.bq4 = file_size;
-		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_LENGTH, hv, sizeof(uint32_t), 0);
-	}
-	else
-	{
-		printf("%s() Got a GET without a name-header!\n", __FUNCTION__);
-		OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
-		return;
-	}
-	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-	if (NULL != buf)
-	{
-		free(buf);
-	}
-	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-out:
-	if (NULL != name)
-	{
-		free(name);
-	}
-	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-	if (NULL != type)
-	{
-		free(type);
-	}
-	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
-	
-	return;
+static void listing_cache_drop(struct listing_cache_entry *entry)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if (entry->wd >= 0)
+		(void) inotify_rm_watch(inotify_fd, entry->wd);
+#endif
+	listing_doc_put(entry->doc);
+	entry->doc = NULL;
+	entry->wd = -1;
+	entry->gen++;
+}
+
+static struct listing_cache_entry *listing_cache_find(const struct stat *st)
+{
+	int i;
+
+	for (i = 0; i < LIST_CACHE_SIZE; i++)
+		if (listing_cache[i].wd >= 0 &&
+		    listing_cache[i].dev == st->st_dev && listing_cache[i].ino == st->st_ino)
+			return &listing_cache[i];
+	return NULL;
+}
+
+/* the cached listing of the folder, with a reference for the caller */
+static struct listing_doc *listing_cache_get(const struct stat *st)
+{
+	struct listing_cache_entry *entry = listing_cache_find(st);
+
+	if (entry == NULL || entry->doc == NULL)
+		return NULL;
+	entry->used = ++listing_clock;
+	entry->doc->refs++;
+	return entry->doc;
 }
 
 /*
- * Function safe_save_file ()
+ * Function listing_cache_reserve()
  *
- *    First remove path and add "/tmp/". Then save.
+ *    Start watching the current folder of session before it is
+ *    listed. Returns the slot to pass to listing_cache_install()
+ *    along with gen, or -1 if the listing can't be cached.
  *
  */
-static int safe_save_file(char *name, const uint8_t *buf, int len)
+static int listing_cache_reserve(struct obexftpd_session *session, const struct stat *st, unsigned int *gen)
 {
-	char *s = NULL;
-	char filename[255] = {0,};
-	int fd;
-	int actual;
-
+#ifdef HAVE_SYS_INOTIFY_H
+	struct listing_cache_entry *entry, *lru = NULL;
+	char *path;
+	int i, wd;
 
-	printf("Filename = %s\n", name);
+	if (inotify_fd < 0)
+		return -1;
 
-	s = strrchr(name, '/');
-	if (s == NULL)
-		s = name;
-	else
-		s++;
+	entry = listing_cache_find(st);
+	if (entry == NULL) {
+		for (i = 0; i < LIST_CACHE_SIZE; i++) {
+			entry = &listing_cache[i];
+			if (entry->wd < 0) {
+				lru = entry;
+				break;
+			}
+			if (lru == NULL || entry->used < lru->used)
+				lru = entry;
+		}
+		entry = lru;
+		listing_cache_drop(entry);
 
-	strncat(filename, s, 250);
-	fd = open(filename, O_RDWR | O_CREAT | O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+		path = malloc(strlen(root_path) + strlen(session->cwd) + 2);
+		if (path == NULL)
+			return -1;
+		sprintf(path, "%s/%s", root_path, session->cwd);
+		wd = inotify_add_watch(inotify_fd, path, LIST_CACHE_MASK);
+		free(path);
+		if (wd < 0)
+			return -1;
 
-	if ( fd < 0) {
-		perror( filename);
-		return -1;
+		entry->wd = wd;
+		entry->dev = st->st_dev;
+		entry->ino = st->st_ino;
 	}
-	
-	actual = write(fd, buf, len);
-	close(fd);
+	entry->used = ++listing_clock;
+	*gen = entry->gen;
+	return entry - listing_cache;
+#else
+	(void) session;
+	(void) st;
+	(void) gen;
+	return -1;
+#endif
+}
 
-	printf( "Wrote %s (%d bytes)\n", filename, actual);
+/* keep a listing built after listing_cache_reserve() unless the folder changed */
+static void listing_cache_install(int slot, unsigned int gen, const char *data, unsigned int size)
+{
+	struct listing_cache_entry *entry = &listing_cache[slot];
+	struct listing_doc *doc;
 
-	return actual;
+	if (entry->gen != gen || entry->wd < 0 || entry->doc != NULL)
+		return;
+	doc = malloc(sizeof(*doc) + size);
+	if (doc == NULL)
+		return;
+	doc->refs = 1;
+	doc->size = size;
+	memcpy(doc->data, data, size);
+	entry->doc = doc;
+}
+
+/* the folder at dirfd is about to change or just did */
+static void listing_cache_forget(int dirfd)
+{
+	struct listing_cache_entry *entry;
+	struct stat st;
+
+	if (inotify_fd < 0 || fstat(dirfd, &st) < 0)
+		return;
+	entry = listing_cache_find(&st);
+	if (entry)
+		listing_cache_drop(entry);
+}
+
+static void listing_cache_notify(struct obexftpd_session *UNUSED(service))
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	int i;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) p;
+			for (i = 0; i < LIST_CACHE_SIZE; i++) {
+				if (event->mask & IN_Q_OVERFLOW) {
+					/* lost track, start over */
+					if (listing_cache[i].wd >= 0)
+						listing_cache_drop(&listing_cache[i]);
+				} else if (listing_cache[i].wd == event->wd) {
+					/* IN_IGNORED: the kernel removed the watch already */
+					if (event->mask & IN_IGNORED)
+						listing_cache[i].wd = -1;
+					listing_cache_drop(&listing_cache[i]);
+				}
+			}
+		}
+	}
+#endif
 }
 
+static int listing_cache_init(void)
+{
+	int i;
+
+	for (i = 0; i < LIST_CACHE_SIZE; i++)
+		listing_cache[i].wd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+	if (inotify_fd >= 0)
+		return inotify_fd;
+	root_path = getcwd(NULL, 0);
+	if (root_path == NULL)
+		return -1;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		log_errno(LVL_WARN, "inotify unavailable, not caching listings");
+	return inotify_fd;
+#else
+	return -1;
+#endif
+}
+//END of folder listing cache
 
+//BEGIN of I/O workers
 /*
- * Function put_done()
- *
- *    Parse what we got from a PUT
- *
+ * File data is read and written by a few worker threads, so a slow
+ * disk only holds up the session waiting for it. Workers hand finished
+ * jobs back through an eventfd watched by the event loop; completions
+ * always run on the main thread. OpenOBEX wants body data right in its
+ * callbacks, so GETs read a chunk ahead and PUTs write behind with a
+ * few chunks in flight. Opening, stat'ing and listing stay inline.
  */
-static void put_done(obex_t *handle, obex_object_t *object, int final)
-{
-	obex_headerdata_t hv;
-	uint8_t hi;
-	uint32_t hlen;
+enum io_op { IO_READ, IO_WRITE, IO_CALL };
 
-	const uint8_t *body = NULL;
-	int body_len = 0;
-	static char *name = NULL;
-	char fullname[WORK_PATH_MAX];
-	struct stat statbuf;
-	//char *namebuf = NULL;
+struct io_job {
+	struct io_job	*next;
+	struct obexftpd_session *session;
+	enum io_op	op;
+	int		fd;
+	uint8_t		*buf;
+	size_t		len;
+	off_t		offset;
+	ssize_t		result;
+	int		error;
+	void		(*run)(struct io_job *job);	/* of an IO_CALL */
+	void		*arg;
+	void		(*complete)(struct io_job *job);
+	long long	us;		/* the job took */
+};
 
-	fprintf(stderr, "put_done>>>\n");
-	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
-		switch(hi)	{
-		case OBEX_HDR_BODY:
-			body = hv.bs;
-			body_len = hlen;
-			fprintf(stderr, "hv.bs=%p, hlen=%d\n", hv.bs, hlen);
-			break;
-		case OBEX_HDR_NAME:
-			if (NULL != name)
-			{
-				free(name);
-			}
-			if( (name = malloc(hlen / 2)))	{
-				OBEX_UnicodeToChar((uint8_t *)name, hv.bs, hlen);
-				fprintf(stderr, "put file name: %s\n", name);
-			}
-			break;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_todo_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *io_todo = NULL, **io_todo_tail = &io_todo;
+static struct io_job *io_done = NULL, **io_done_tail = &io_done;
+static pthread_t *io_workers = NULL;
+static int io_running = 0;
+#endif
+static int io_notify_fd[2] = { -1, -1 }; /* read and write end, the same for an eventfd */
+static int io_detached = 0; /* pending jobs of no session */
 
-		case OBEX_HDR_LENGTH:
-			printf("HEADER_LENGTH = %d\n", hv.bq4);
-			break;
+static void io_run(struct io_job *job)
+{
+	long long start = now_us();
+	size_t done = 0;
+	ssize_t ret;
 
-		case HDR_CREATOR:
-			printf("CREATORID = %#x\n", hv.bq4);
-			break;
-		
-		default:
-			printf("%s () Skipped header %02x\n", __FUNCTION__ , hi);
+	job->error = 0;
+	if (job->op == IO_CALL) {
+		job->result = 0;
+		job->run(job);
+	} else if (job->op == IO_READ) {
+		do {
+			ret = pread(job->fd, job->buf, job->len, job->offset);
+		} while (ret < 0 && errno == EINTR);
+		job->result = ret;
+	} else {
+		while (done < job->len) {
+			ret = pwrite(job->fd, job->buf + done, job->len - done, job->offset + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
 		}
+		job->result = done < job->len ? -1 : (ssize_t) done;
+		if (done < job->len && (ret == 0 || errno == 0))
+			errno = ENOSPC;
 	}
-	if(!body)	{
-		printf("Got a PUT without a body\n");
-		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-	}
-	if(!name)	{
-		name = strdup("OBEX_PUT_Unknown_object");
-		printf("Got a PUT without a name. Setting name to %s\n", name);
+	if (job->result < 0)
+		job->error = errno;
+	job->us = now_us() - start;
+}
 
-	}
-	if (body)
-	{
-		safe_save_file(name, body, body_len);
-	}
-	if(final && !body) {
-		strcpy(fullname, CUR_DIR);
-		strcat(fullname, name);
-		if (!stat(fullname, &statbuf)) {
-			perror("stat failed");
-		}
-		if (S_ISDIR(statbuf.st_mode)) {
-			printf("Removing dir %s\n", name);
-			rmdir(fullname);
-		} else {
-			printf("Deleting file %s\n", name);
-			unlink(fullname);
+static void io_finish(struct io_job *job)
+{
+	if (job->session)
+		job->session->io_pending--;
+	else
+		io_detached--;
+	hist_observe(&metrics.io_job, job->us);
+	job->complete(job);
+	free(job);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *io_worker(void *UNUSED(arg))
+{
+	struct io_job *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&io_lock);
+	/* jobs queued when stopping are still done */
+	while (io_running || io_todo) {
+		if (io_todo == NULL) {
+			pthread_cond_wait(&io_todo_cond, &io_lock);
+			continue;
 		}
+		job = io_todo;
+		io_todo = job->next;
+		if (io_todo == NULL)
+			io_todo_tail = &io_todo;
+		pthread_mutex_unlock(&io_lock);
+
+		io_run(job);
+
+		pthread_mutex_lock(&io_lock);
+		job->next = NULL;
+		*io_done_tail = job;
+		io_done_tail = &job->next;
+		pthread_cond_broadcast(&io_done_cond);
+		/* an eventfd adds up, a pipe just needs to be readable */
+		(void) write(io_notify_fd[1], &one, sizeof(one));
 	}
-	if (final)
-	{
-		free(name);
-		name = NULL;
-		fprintf(stderr, "<<<put_done\n");
+	pthread_mutex_unlock(&io_lock);
+	return NULL;
+}
+#endif
+
+/* run completions of finished jobs */
+static void io_reap(void)
+{
+#ifdef HAVE_PTHREAD_H
+	struct io_job *job, *next;
+
+	pthread_mutex_lock(&io_lock);
+	job = io_done;
+	io_done = NULL;
+	io_done_tail = &io_done;
+	pthread_mutex_unlock(&io_lock);
+
+	for (; job; job = next) {
+		next = job->next;
+		io_finish(job);
 	}
+#endif
 }
 
+static void io_notify(struct obexftpd_session *UNUSED(service))
+{
+	uint8_t buf[64];
+
+	while (read(io_notify_fd[0], buf, sizeof(buf)) > 0)
+		;
+	io_reap();
+}
 
 /*
- * Function server_indication()
+ * Function io_submit()
  *
- * Called when a request is about to come or has come.
+ *    Queue a job, its completion runs from the event loop or
+ *    io_wait(). Without workers it is done right away. Jobs
+ *    without a session are counted in io_detached.
  *
  */
-static void server_request(obex_t *handle, obex_object_t *object, int UNUSED(event), int cmd)
+static void io_submit(struct io_job *job)
 {
-	switch(cmd)	{
-	case OBEX_CMD_SETPATH:
-		printf("Received SETPATH command\n");
-		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-		set_server_path(handle, object);
-		break;
-	case OBEX_CMD_GET:
-		/* A Get always fits one package */
-		get_server(handle, object);
-		break;
-	case OBEX_CMD_PUT:
-		printf("Received PUT command\n");
-		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-		put_done(handle, object, 1);
-		break;
-	case OBEX_CMD_CONNECT:
-//		OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
-		connect_server(handle, object);
-		connection_id++;
-		break;
-	case OBEX_CMD_DISCONNECT:
-		OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
-		break;
-	default:
-		printf("%s () Denied %02x request\n", __FUNCTION__, cmd);
-		OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_IMPLEMENTED, OBEX_RSP_NOT_IMPLEMENTED);
-		break;
+	if (job->session)
+		job->session->io_pending++;
+	else
+		io_detached++;
+#ifdef HAVE_PTHREAD_H
+	if (io_running) {
+		pthread_mutex_lock(&io_lock);
+		job->next = NULL;
+		*io_todo_tail = job;
+		io_todo_tail = &job->next;
+		pthread_cond_signal(&io_todo_cond);
+		pthread_mutex_unlock(&io_lock);
+		return;
+	}
+#endif
+	io_run(job);
+	io_finish(job);
+}
+
+/* block until no more than max_pending jobs are left */
+static void io_wait_for(int *pending, int max_pending)
+{
+#ifdef HAVE_PTHREAD_H
+	long long start;
+
+	if (*pending <= max_pending)
+		return;
+	start = now_us();
+	while (*pending > max_pending) {
+		pthread_mutex_lock(&io_lock);
+		while (io_done == NULL)
+			pthread_cond_wait(&io_done_cond, &io_lock);
+		pthread_mutex_unlock(&io_lock);
+		io_reap();
+	}
+	hist_observe(&metrics.io_wait, now_us() - start);
+#else
+	(void) pending;
+	(void) max_pending;
+#endif
+}
+
+static void io_wait(struct obexftpd_session *session, int max_pending)
+{
+	io_wait_for(&session->io_pending, max_pending);
+}
+
+static struct io_job *io_job_new(struct obexftpd_session *session, enum io_op op,
+				 int fd, uint8_t *buf, size_t len, off_t offset,
+				 void (*complete)(struct io_job *job))
+{
+	struct io_job *job = calloc(1, sizeof(*job));
+
+	if (job == NULL)
+		return NULL;
+	job->session = session;
+	job->op = op;
+	job->fd = fd;
+	job->buf = buf;
+	job->len = len;
+	job->offset = offset;
+	job->complete = complete;
+	return job;
+}
+
+/* start threads workers, 0 does all I/O inline */
+static int io_init(int threads)
+{
+#ifdef HAVE_PTHREAD_H
+	int i, flags;
+
+	if (threads <= 0 || io_running)
+		return 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	io_notify_fd[0] = io_notify_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io_notify_fd[0] < 0)
+		return -1;
+#else
+	if (pipe(io_notify_fd) < 0)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(io_notify_fd[i], F_GETFL);
+		(void) fcntl(io_notify_fd[i], F_SETFL, flags | O_NONBLOCK);
+	}
+#endif
+	(void) flags;
+
+	io_workers = calloc(threads, sizeof(*io_workers));
+	io_running = 1;
+	for (i = 0; io_workers && i < threads; i++) {
+		if (pthread_create(&io_workers[i], NULL, io_worker, NULL) != 0)
+			break;
+	}
+	if (i == 0) {
+		io_running = 0;
+		free(io_workers);
+		io_workers = NULL;
+		close(io_notify_fd[0]);
+		if (io_notify_fd[1] != io_notify_fd[0])
+			close(io_notify_fd[1]);
+		io_notify_fd[0] = io_notify_fd[1] = -1;
+		return -1;
+	}
+	io_threads = i;
+#else
+	(void) threads;
+#endif
+	return 0;
+}
+
+static void io_stop(void)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+
+	if (!io_running)
+		return;
+	pthread_mutex_lock(&io_lock);
+	io_running = 0;
+	pthread_cond_broadcast(&io_todo_cond);
+	pthread_mutex_unlock(&io_lock);
+	for (i = 0; i < io_threads; i++)
+		pthread_join(io_workers[i], NULL);
+	io_reap();
+	free(io_workers);
+	io_workers = NULL;
+	close(io_notify_fd[0]);
+	if (io_notify_fd[1] != io_notify_fd[0])
+		close(io_notify_fd[1]);
+	io_notify_fd[0] = io_notify_fd[1] = -1;
+#endif
+}
+//END of I/O workers
+
+//BEGIN of the blob store
+/*
+ * With --dedup uploads are hashed while they stream in and each content
+ * is kept once in a store folder, named by its SHA-256 as xx/yyyy...
+ * Every name given to the same content is a hard link to its blob, so
+ * the link count is the reference count: a blob left with one link is
+ * no longer referenced and goes when its last name is deleted, or with
+ * the sweep at startup. Stored files are made read-only, as changing
+ * one in place would change all of them. The hash is noted on the file
+ * in an extended attribute, shared by all its links, so deleting a name
+ * needn't read the file to find its blob.
+ */
+#define BLOB_NAME_SIZE		(2 * SHA256_DIGEST_SIZE + 2)
+#define BLOB_XATTR		"user.obexftpd.sha256"
+
+static int blob_fd = -1; /* the store folder, -1 without dedup */
+
+static void blob_name(const uint8_t *digest, char *name)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i, j = 0;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		name[j++] = hex[digest[i] >> 4];
+		name[j++] = hex[digest[i] & 0xf];
+		if (i == 0)
+			name[j++] = '/';
+	}
+	name[j] = '\0';
+}
+
+static int blob_open(const char *path)
+{
+	if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST)
+		return -1;
+	blob_fd = open(path, O_RDONLY | O_DIRECTORY);
+	return blob_fd < 0 ? -1 : 0;
+}
+
+/* note the hash on the file, before it is made read-only */
+static void blob_tag(int fd, const uint8_t *digest)
+{
+#ifdef HAVE_FGETXATTR
+	(void) fsetxattr(fd, BLOB_XATTR, digest, SHA256_DIGEST_SIZE, 0);
+#else
+	(void) fd;
+	(void) digest;
+#endif
+}
+
+/*
+ * Function blob_link()
+ *
+ *    Link target in dirfd to the blob if the content is known and
+ *    drop the temp file. Otherwise the temp file becomes the blob
+ *    and 1 tells the caller to link it to target as usual. Doesn't
+ *    touch any state, workers call it too.
+ *
+ */
+static int blob_link(int dirfd, const char *tmp, const char *target, const char *blob)
+{
+	char sub[3];
+
+	if (linkat(blob_fd, blob, dirfd, target, 0) == 0) {
+		(void) unlinkat(dirfd, tmp, 0);
+		return 0;
+	}
+	if (errno == EEXIST)
+		return -1;
+	/* e.g. too many links, then it keeps a copy of its own */
+	if (errno != ENOENT)
+		return 1;
+
+	memcpy(sub, blob, 2);
+	sub[2] = '\0';
+	if (mkdirat(blob_fd, sub, S_IRWXU) < 0 && errno != EEXIST)
+		return 1;
+	(void) linkat(dirfd, tmp, blob_fd, blob, 0);
+	return 1;
+}
+
+/*
+ * Function blob_lookup()
+ *
+ *    Find the blob of the file base in dirfd if deleting it would
+ *    leave the blob unreferenced. The hash comes from the file's
+ *    attribute, files without one are hashed.
+ *
+ */
+static int blob_lookup(int dirfd, const char *base, const struct stat *st, char *blob)
+{
+	struct sha256_ctx hash;
+	uint8_t buf[16384], digest[SHA256_DIGEST_SIZE];
+	struct stat blob_st;
+	ssize_t n = -1;
+	int fd;
+
+	if (blob_fd < 0 || !S_ISREG(st->st_mode) || st->st_nlink != 2)
+		return -1;
+	fd = openat(dirfd, base, O_RDONLY);
+	if (fd < 0)
+		return -1;
+#ifdef HAVE_FGETXATTR
+	n = fgetxattr(fd, BLOB_XATTR, digest, sizeof(digest));
+#endif
+	/* stored before the attribute was, or where there are none */
+	if (n != SHA256_DIGEST_SIZE) {
+		sha256_init(&hash);
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			sha256_update(&hash, buf, n);
+		if (n == 0)
+			sha256_final(&hash, digest);
+	}
+	close(fd);
+	if (n < 0)
+		return -1;
+	blob_name(digest, blob);
+
+	/* some other hard link, or an attribute that doesn't fit */
+	if (fstatat(blob_fd, blob, &blob_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    blob_st.st_dev != st->st_dev || blob_st.st_ino != st->st_ino)
+		return -1;
+	return 0;
+}
+
+/* drop the blob if no name refers to it any more */
+static void blob_release(const char *blob)
+{
+	struct stat st;
+
+	if (fstatat(blob_fd, blob, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_nlink == 1) {
+		log_debug("Removing blob %s", blob);
+		(void) unlinkat(blob_fd, blob, 0);
+	}
+}
+
+/* remove blobs that lost all their names, e.g. deleted by someone else */
+static void blob_sweep(void)
+{
+	DIR *top, *dir;
+	struct dirent *sub, *ent;
+	struct stat st;
+	int fd, swept = 0;
+
+	fd = dup(blob_fd);
+	top = fd >= 0 ? fdopendir(fd) : NULL;
+	if (top == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	rewinddir(top);
+	while ((sub = readdir(top)) != NULL) {
+		if (sub->d_name[0] == '.')
+			continue;
+		fd = openat(blob_fd, sub->d_name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+		dir = fdopendir(fd);
+		if (dir == NULL) {
+			close(fd);
+			continue;
+		}
+		while ((ent = readdir(dir)) != NULL)
+			if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			    S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+			    unlinkat(fd, ent->d_name, 0) == 0)
+				swept++;
+		closedir(dir);
+	}
+	closedir(top);
+	if (swept)
+		log_info("Removed %d unreferenced blobs", swept);
+}
+//END of the blob store
+
+//BEGIN of durable uploads
+/*
+ * Uploads go to a temp file next to their target and are linked into
+ * place when complete, so a name never shows a partial file. How much
+ * survives a crash is up to sync_mode: SYNC_NONE leaves flushing to the
+ * kernel, SYNC_FILE fsyncs each file before and its folder after the
+ * link, SYNC_GROUP hands finished uploads of all sessions to an I/O
+ * worker every sync_interval ms, which fsyncs and links them as one
+ * batch. The response to a group commit is held back until its batch
+ * is through, and the name is taken from when it is queued.
+ */
+struct sync_entry {
+	struct sync_entry *next;
+	struct obexftpd_session *session; /* waiting for the result, if any */
+	obex_object_t	*object;	/* its request */
+	int		dirfd;		/* a dup of the session's */
+	dev_t		dir_dev;	/* of that folder */
+	ino_t		dir_ino;
+	int		fd;		/* of the temp file */
+	char		*tmp;
+	char		*target;
+	char		blob[BLOB_NAME_SIZE];	/* empty without --dedup */
+	int		error;
+};
+
+static struct sync_entry *sync_queue = NULL, **sync_queue_tail = &sync_queue;
+static struct sync_entry *sync_batch = NULL; /* with the workers */
+static long long sync_due = 0; /* us the queue is flushed at */
+static int sync_busy = 0; /* a batch is with the workers */
+
+static uint8_t put_error_rsp(int error);
+static int loop_suspend(struct obexftpd_session *session, obex_object_t *object);
+static void loop_resume(struct obexftpd_session *session);
+
+/*
+ * Function commit_file()
+ *
+ *    Link the temp file tmp in dirfd to target, or the blob of its
+ *    content if blob is given. Existing files are not replaced.
+ *    Doesn't touch any state, workers call it too.
+ *
+ */
+static int commit_file(int dirfd, const char *tmp, const char *target, const char *blob)
+{
+	struct stat statbuf;
+	int ret;
+
+	if (blob && blob_fd >= 0) {
+		ret = blob_link(dirfd, tmp, target, blob);
+		if (ret <= 0)
+			return ret;
+	}
+	if (linkat(dirfd, tmp, dirfd, target, 0) < 0) {
+		if (errno == EEXIST)
+			return -1;
+		/* no hard links here, e.g. on FAT */
+		if (fstatat(dirfd, target, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+			errno = EEXIST;
+			return -1;
+		}
+		return renameat(dirfd, tmp, dirfd, target);
+	}
+	(void) unlinkat(dirfd, tmp, 0);
+	return 0;
+}
+
+static void sync_entry_free(struct sync_entry *entry)
+{
+	if (entry->fd >= 0)
+		close(entry->fd);
+	if (entry->dirfd >= 0)
+		close(entry->dirfd);
+	free(entry->tmp);
+	free(entry->target);
+	free(entry);
+}
+
+/* on a worker: flush and link a batch, then flush the folders */
+static void sync_batch_run(struct io_job *job)
+{
+	struct sync_entry *entry;
+
+	for (entry = job->arg; entry; entry = entry->next) {
+		if (fsync(entry->fd) < 0)
+			entry->error = errno;
+		close(entry->fd);
+		entry->fd = -1;
+		if (!entry->error && commit_file(entry->dirfd, entry->tmp, entry->target,
+						       entry->blob[0] ? entry->blob : NULL) < 0)
+			entry->error = errno;
+		if (entry->error)
+			(void) unlinkat(entry->dirfd, entry->tmp, 0);
+	}
+	/* a folder fsync that has nothing to do is cheap */
+	for (entry = job->arg; entry; entry = entry->next)
+		if (!entry->error && fsync(entry->dirfd) < 0)
+			entry->error = errno;
+}
+
+static void sync_batch_done(struct io_job *job)
+{
+	struct sync_entry *entry, *next;
+
+	sync_batch = NULL;
+	for (entry = job->arg; entry; entry = next) {
+		next = entry->next;
+		if (entry->error)
+			log_error("Failed to commit %s: %s", entry->target, strerror(entry->error));
+		else
+			log_info("Wrote %s", entry->target);
+		listing_cache_forget(entry->dirfd);
+		/* now the client hears how it went */
+		if (entry->session) {
+			if (entry->error) {
+				uint8_t rsp = put_error_rsp(entry->error);
+				OBEX_ObjectSetRsp(entry->object, rsp, rsp);
+			}
+			loop_resume(entry->session);
+		}
+		sync_entry_free(entry);
+	}
+	sync_busy = 0;
+}
+
+/* hand the queue to the workers, one batch at a time */
+static void sync_flush(void)
+{
+	struct io_job *job;
+
+	if (sync_queue == NULL || sync_busy)
+		return;
+	job = io_job_new(NULL, IO_CALL, -1, NULL, 0, 0, sync_batch_done);
+	if (job == NULL)
+		return;
+	job->run = sync_batch_run;
+	job->arg = sync_queue;
+	sync_batch = sync_queue;
+	sync_queue = NULL;
+	sync_queue_tail = &sync_queue;
+	sync_busy = 1;
+	io_submit(job);
+}
+
+/* flush the queue if it is due */
+static void sync_check(void)
+{
+	if (sync_queue && now_us() >= sync_due)
+		sync_flush();
+}
+
+/* shorten the event loop timeout (ms) to when the queue is due */
+static int sync_timeout(int timeout)
+{
+	long long left;
+
+	/* a busy batch wakes the loop through io_notify() */
+	if (sync_queue == NULL || sync_busy)
+		return timeout;
+	left = (sync_due - now_us() + 999) / 1000;
+	if (left < 0)
+		left = 0;
+	return timeout < 0 || left < timeout ? (int) left : timeout;
+}
+
+/* whether target in the folder dir is queued or being committed */
+static int sync_taken(const struct stat *dir, const char *target)
+{
+	struct sync_entry *entry;
+
+	for (entry = sync_queue; entry; entry = entry->next)
+		if (entry->dir_ino == dir->st_ino && entry->dir_dev == dir->st_dev &&
+		    !strcmp(entry->target, target))
+			return 1;
+	/* the workers don't change the list, just the entries' files */
+	for (entry = sync_batch; entry; entry = entry->next)
+		if (entry->dir_ino == dir->st_ino && entry->dir_dev == dir->st_dev &&
+		    !strcmp(entry->target, target))
+			return 1;
+	return 0;
+}
+
+/*
+ * Function sync_defer()
+ *
+ *    Queue the finished temp file of session for the next group
+ *    commit, as target or a link to blob, and hold the response to
+ *    object back until then. The session lets go of the temp file.
+ *    Returns 1 if the response can't be held back, the caller then
+ *    commits right away.
+ *
+ */
+static int sync_defer(struct obexftpd_session *session, obex_object_t *object,
+		      const char *target, const char *blob)
+{
+	struct sync_entry *entry;
+	struct stat statbuf, dir;
+
+	/* the commit checks again, but most clashes show up here */
+	if (fstatat(session->dirfd, target, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 ||
+	    (fstat(session->dirfd, &dir) == 0 && sync_taken(&dir, target))) {
+		errno = EEXIST;
+		return -1;
+	}
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return -1;
+	entry->fd = -1;
+	entry->dirfd = dup(session->dirfd);
+	entry->target = strdup(target);
+	if (entry->dirfd < 0 || entry->target == NULL || fstat(entry->dirfd, &dir) < 0) {
+		sync_entry_free(entry);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (loop_suspend(session, object) < 0) {
+		sync_entry_free(entry);
+		return 1;
+	}
+	entry->session = session;
+	entry->object = object;
+	entry->dir_dev = dir.st_dev;
+	entry->dir_ino = dir.st_ino;
+	if (blob)
+		strcpy(entry->blob, blob);
+	entry->fd = session->put_fd;
+	entry->tmp = session->put_tmp;
+	session->put_fd = -1;
+	session->put_tmp = NULL;
+
+	if (sync_queue == NULL)
+		sync_due = now_us() + sync_interval * 1000LL;
+	*sync_queue_tail = entry;
+	sync_queue_tail = &entry->next;
+	return 0;
+}
+
+/* a session going away doesn't wait for its commits any more */
+static void sync_forget(struct obexftpd_session *session)
+{
+	struct sync_entry *entry;
+
+	for (entry = sync_queue; entry; entry = entry->next)
+		if (entry->session == session)
+			entry->session = NULL;
+	for (entry = sync_batch; entry; entry = entry->next)
+		if (entry->session == session)
+			entry->session = NULL;
+}
+
+/* commit all that is queued before shutting down */
+static void sync_stop(void)
+{
+	io_wait_for(&io_detached, 0);
+	sync_flush();
+	io_wait_for(&io_detached, 0);
+}
+//END of durable uploads
+
+inline static int is_type_fl(const char *type)
+{
+	return (type && strcmp(type, XOBEX_LISTING) == 0);
+}
+
+static void connect_server(struct obexftpd_session *session, obex_object_t *object)
+{
+	obex_t *handle = session->handle;
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hlen;
+	uint8_t *target = NULL;
+	int target_len = 0;
+
+	//printf("%s()\n", __FUNCTION__);
+
+	while (OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen)) {
+		switch(hi) {
+		case OBEX_HDR_TARGET:
+			if (0 < hlen)
+			{
+				if( (target = malloc(hlen))) {
+					target_len = hlen;
+					memcpy(target,hv.bs,target_len);
+				}
+			}
+			break;
+		default:	
+			log_debug("%s() Skipped header %02x", __FUNCTION__, hi);
+			break;
+		}
+	}
+
+	OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
+	session->connection_id = next_connection_id++;
+	hv.bq4 = session->connection_id;
+	if(OBEX_ObjectAddHeader(handle, object, OBEX_HDR_CONNECTION,
+              		hv, sizeof(hv.bq4),
+                            OBEX_FL_FIT_ONE_PACKET) < 0 )    {
+                log_error("Error adding header CONNECTION");
+                OBEX_ObjectDelete(handle, object);
+                return;
+        }
+	if (target && target_len) {
+		hv.bs = target;
+		if(OBEX_ObjectAddHeader(handle,object,OBEX_HDR_WHO,
+					hv,target_len,OBEX_FL_FIT_ONE_PACKET) < 0 ) {
+			log_error("Error adding header WHO");
+			OBEX_ObjectDelete(handle, object);
+			return;
+		}
+		free(target);
+	} 
+}
+
+
+static void set_server_path(struct obexftpd_session *session, obex_object_t *object)
+{
+	obex_t *handle = session->handle;
+	char *name = NULL;
+	char *path = NULL;
+	const char *base;
+	int has_name = 0;
+	int fd;
+
+	// "Backup Level" and "Don't Create" flag in first byte
+	uint8_t setpath_nohdr_dummy = 0;
+	uint8_t *setpath_nohdr_data;
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hlen;
+
+	OBEX_ObjectGetNonHdrData(object, &setpath_nohdr_data);
+	if (NULL == setpath_nohdr_data) {
+		setpath_nohdr_data = &setpath_nohdr_dummy;
+		log_debug("nohdr data not found");
+	}
+	log_debug("nohdr data: %x", *setpath_nohdr_data);
+
+	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
+		switch(hi)	{
+		case OBEX_HDR_NAME:
+			log_debug("%s() Found name", __FUNCTION__);
+			has_name = 1;
+			if (0 < hlen)
+			{
+				if( (name = malloc(hlen / 2)))	{
+					OBEX_UnicodeToChar((uint8_t*)name, hv.bs, hlen);
+					log_debug("name:%s", name);
+				}
+			}
+			break;
+			
+		default:
+			log_debug("%s() Skipped header %02x", __FUNCTION__, hi);
+		}
+	}	
+
+	if (*setpath_nohdr_data & 1) {
+		/* back up a level, not beyond the root */
+		char *s = strrchr(session->cwd, '/');
+		if (*session->cwd == '\0') {
+			OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_FORBIDDEN);
+			goto out;
+		}
+		path = s ? strndup(session->cwd, s - session->cwd) : strdup("");
+	} else if (has_name && !name) {
+		log_info("set path to root");
+		path = strdup("");
+	} else
+		path = strdup(session->cwd);
+	if (path == NULL)
+		goto fail;
+
+	if (name)
+	{
+		char *fullname = join_path(path, name);
+		free(path);
+		path = fullname;
+		if (path == NULL)
+		{
+			OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_FORBIDDEN);
+			goto out;
+		}
+		if ((*setpath_nohdr_data & 2) == 0) {
+			log_info("mkdir %s", path);
+			fd = session_parent(session, path, &base);
+			if (fd < 0 || (*base && mkdirat(fd, base, 0755) < 0 && errno != EEXIST)) {
+				log_errno(LVL_INFO, "requested mkdir failed");
+			} else
+				listing_cache_forget(fd);
+		}
+	}
+
+	log_info("Set path to /%s", path);
+	if (session_chdir(session, path) < 0)
+		goto fail;
+	path = NULL; /* owned by the session now */
+	goto out;
+
+fail:
+	log_errno(LVL_INFO, "requested chdir failed");
+	OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE,
+			errno == ENOENT ? OBEX_RSP_NOT_FOUND : OBEX_RSP_FORBIDDEN);
+out:
+	free(path);
+	free(name);
+}
+
+//
+// Open a file to stream it, refusing anything but regular files
+//
+static int open_file(int dirfd, const char *filename, int *file_size)
+{
+	struct stat stats;
+	int fd;
+
+	fd = openat(dirfd, filename, O_RDONLY | O_NOFOLLOW, 0);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	if (fstat(fd, &stats) < 0 || !S_ISREG(stats.st_mode)) {
+		log_info("GET of directories not implemented !!!!");
+		close(fd);
+		return -1;
+	}
+	*file_size = (int) stats.st_size;
+	log_debug("name=%s, size=%d", filename, *file_size);
+
+	return fd;
+}
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+static long page_size = 4096;
+
+/*
+ * Function map_sigbus()
+ *
+ *    OpenOBEX copies from a mapping when it sends, so a file truncated
+ *    meanwhile faults there. Zero pages are put over the missing part
+ *    so the copy can finish, and the session is dropped afterwards.
+ *    Other faults get the default action.
+ *
+ *    Walking sessions and calling mmap() isn't async-signal-safe. It
+ *    only works because the fault is synchronous, on the main thread
+ *    while it sends, so the list can't be changing under us. No other
+ *    thread, e.g. an I/O worker, may ever touch a mapping.
+ *
+ */
+static void map_sigbus(int sig, siginfo_t *info, void *UNUSED(context))
+{
+	struct obexftpd_session *session;
+	const uint8_t *addr = info->si_addr;
+	void *page;
+
+	for (session = sessions; session; session = session->next) {
+		if (session->get_map == NULL || addr < session->get_map ||
+		    addr >= session->get_map + session->get_size)
+			continue;
+		page = (void *) ((uintptr_t) addr & ~(uintptr_t) (page_size - 1));
+		if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+			 -1, 0) == MAP_FAILED)
+			break;
+		session->get_truncated = 1;
+		return;
+	}
+	/* the faulting access is retried and kills us */
+	signal(sig, SIG_DFL);
+}
+
+static void map_init(void)
+{
+	struct sigaction sa;
+
+	if (sysconf(_SC_PAGESIZE) > 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = map_sigbus;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGBUS, &sa, NULL) < 0) {
+		log_errno(LVL_WARN, "can't catch SIGBUS, reading instead of mapping");
+		use_mmap = 0;
+	}
+}
+#else
+static void map_init(void)
+{
+	use_mmap = 0;
+}
+#endif
+
+/*
+ * Function map_file()
+ *
+ *    Map the file to stream it without copying it to stream_chunk
+ *    first. OpenOBEX reads the body straight from the mapping.
+ *
+ */
+static void map_file(struct obexftpd_session *session, int file_size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	void *map;
+
+	if (!use_mmap || file_size <= 0)
+		return;
+	map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, session->get_fd, 0);
+	if (map == MAP_FAILED) {
+		log_errno(LVL_WARN, "mmap failed, reading instead");
+		return;
+	}
+#ifdef MADV_SEQUENTIAL
+	(void) madvise(map, file_size, MADV_SEQUENTIAL);
+#endif
+	session->get_map = map;
+	session->get_size = file_size;
+	session->get_pos = 0;
+	session->get_truncated = 0;
+#else
+	(void) session;
+	(void) file_size;
+#endif
+}
+
+static void get_read_done(struct io_job *job)
+{
+	struct obexftpd_session *session = job->session;
+
+	session->read_len = job->result;
+	session->read_error = job->error;
+	session->read_ready = 1;
+	if (job->result > 0)
+		session->read_offset += job->result;
+}
+
+/*
+ * Function get_read_ahead()
+ *
+ *    Have the next chunk of the file read into stream_next
+ *    while the current one is sent
+ *
+ */
+static void get_read_ahead(struct obexftpd_session *session)
+{
+	struct io_job *job;
+
+	session->read_ready = 0;
+	job = io_job_new(session, IO_READ, session->get_fd, session->stream_next,
+			 STREAM_CHUNK, session->read_offset, get_read_done);
+	if (job == NULL) {
+		session->read_len = -1;
+		session->read_error = ENOMEM;
+		session->read_ready = 1;
+		return;
+	}
+	io_submit(job);
+}
+
+static void end_get(struct obexftpd_session *session)
+{
+	/* a worker may still be reading into stream_next */
+	io_wait(session, 0);
+	if (session->list_dir) {
+		closedir(session->list_dir);
+		session->list_dir = NULL;
+	}
+	if (session->list_data) {
+		FREE_RAWDATA_STREAM(session->list_data);
+		session->list_data = NULL;
+	}
+	if (session->list_build) {
+		FREE_RAWDATA_STREAM(session->list_build);
+		session->list_build = NULL;
+	}
+	if (session->list_doc) {
+		listing_doc_put(session->list_doc);
+		session->list_doc = NULL;
+	}
+#ifdef HAVE_SYS_MMAN_H
+	if (session->get_map) {
+		munmap((void *) session->get_map, session->get_size);
+		session->get_map = NULL;
+	}
+#endif
+	if (session->get_fd >= 0) {
+		close(session->get_fd);
+		session->get_fd = -1;
+	}
+}
+
+/*
+ * Function get_fillstream()
+ *
+ *    Add the next chunk of the file to a streamed GET response
+ *
+ */
+static int get_fillstream(struct obexftpd_session *session, obex_object_t *object)
+{
+	obex_headerdata_t hv;
+	int actual;
+
+	if (session->get_fd < 0)
+		return -1;
+
+	if (session->get_map) {
+		struct stat stats;
+
+		actual = session->get_size - session->get_pos;
+		if (actual > MMAP_CHUNK)
+			actual = MMAP_CHUNK;
+		/* catch most truncations before map_sigbus() has to */
+		if (actual > 0 && (fstat(session->get_fd, &stats) < 0 ||
+		    (size_t) stats.st_size < session->get_pos + actual)) {
+			errno = EIO;
+			actual = -1;
+		}
+		hv.bs = session->get_map + session->get_pos;
+		if (actual > 0)
+			session->get_pos += actual;
+	} else {
+		uint8_t *chunk;
+
+		/* OpenOBEX is done with stream_chunk, swap in the read ahead */
+		if (!session->read_ready)
+			io_wait(session, 0);
+		actual = session->read_len;
+		errno = session->read_error;
+		chunk = session->stream_next;
+		session->stream_next = session->stream_chunk;
+		session->stream_chunk = chunk;
+		hv.bs = (const uint8_t *) chunk;
+		if (actual > 0)
+			get_read_ahead(session);
+	}
+
+	if (actual > 0) {
+		(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+				hv, actual, OBEX_FL_STREAM_DATA);
+	}
+	else if (actual == 0) {
+		/* EOF */
+		end_get(session);
+		(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+				hv, 0, OBEX_FL_STREAM_DATAEND);
+	}
+	else {
+		/* Error, makes OpenOBEX abort the request */
+		log_errno(LVL_ERROR, "read failed");
+		end_get(session);
+		hv.bs = NULL;
+		(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+				hv, 0, OBEX_FL_STREAM_DATA);
+	}
+
+	return actual;
+}
+
+/*
+ * Function list_fillstream()
+ *
+ *    Add the next batch of entries to a streamed folder listing
+ *
+ */
+static int list_fillstream(struct obexftpd_session *session, obex_object_t *object)
+{
+	struct rawdata_stream *xmldata = session->list_data;
+	struct dirent *dirp = NULL;
+	struct stat statbuf;
+	obex_headerdata_t hv;
+	long long start = now_us();
+	int actual;
+
+	if (session->list_flushed) {
+		if (session->list_dir == NULL) {
+			/* the footer went out last time */
+			end_get(session);
+			hv.bs = NULL;
+			(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+					hv, 0, OBEX_FL_STREAM_DATAEND);
+			return 0;
+		}
+		xmldata->size = 0;
+		xmldata->data[0] = '\0';
+	}
+
+	while (NULL != session->list_dir && xmldata->size < LIST_CHUNK &&
+	       NULL != (dirp = readdir(session->list_dir)))
+	{
+		if (0 == strcmp(dirp->d_name, ".") || 0 == strcmp(dirp->d_name, ".."))
+			continue;
+
+		/* uploads in progress */
+		if (0 == strncmp(dirp->d_name, PUT_TEMP_PREFIX, sizeof(PUT_TEMP_PREFIX) - 1))
+			continue;
+
+		if (0 > fstatat(dirfd(session->list_dir), dirp->d_name, &statbuf, AT_SYMLINK_NOFOLLOW))
+			continue;
+
+		FL_XML_BODY_ITEM(xmldata, dirp->d_name, &statbuf, session->list_stat.st_mode);
+	}
+	session->list_build_us += now_us() - start;
+	if (NULL == dirp) {
+		FL_XML_BODY_END(xmldata);
+		if (NULL != session->list_dir)
+			closedir(session->list_dir);
+		session->list_dir = NULL;
+		hist_observe(&metrics.listing_build, session->list_build_us);
+	}
+
+	if (session->list_build) {
+		struct rawdata_stream *build = session->list_build;
+		if (build->size + xmldata->size > LIST_CACHE_MAX_DOC ||
+		    0 > ADD_RAWDATA_STREAM_BYTES(build, xmldata->data, xmldata->size)) {
+			FREE_RAWDATA_STREAM(build);
+			session->list_build = NULL;
+		} else if (NULL == session->list_dir) {
+			listing_cache_install(session->list_slot, session->list_gen,
+					      build->data, build->size);
+			FREE_RAWDATA_STREAM(build);
+			session->list_build = NULL;
+		}
+	}
+	log_debug("xml doc:%s", xmldata->data);
+
+	/* stays valid until the next OBEX_EV_STREAMEMPTY */
+	actual = xmldata->size;
+	hv.bs = (const uint8_t *) xmldata->data;
+	(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+			hv, actual, OBEX_FL_STREAM_DATA);
+	session->list_flushed = 1;
+	return actual;
+}
+
+/*
+ * Function doc_fillstream()
+ *
+ *    Send a cached folder listing
+ *
+ */
+static int doc_fillstream(struct obexftpd_session *session, obex_object_t *object)
+{
+	struct listing_doc *doc = session->list_doc;
+	obex_headerdata_t hv;
+	int actual;
+
+	actual = doc->size - session->list_pos;
+	hv.bs = (const uint8_t *) doc->data + session->list_pos;
+	if (actual > 0) {
+		/* our reference keeps it valid until the end of the GET */
+		session->list_pos = doc->size;
+		(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+				hv, actual, OBEX_FL_STREAM_DATA);
+	} else {
+		end_get(session);
+		(void) OBEX_ObjectAddHeader(session->handle, object, OBEX_HDR_BODY,
+				hv, 0, OBEX_FL_STREAM_DATAEND);
+	}
+	return actual;
+}
+
+static void get_server(struct obexftpd_session *session, obex_object_t *object)
+{
+	obex_t *handle = session->handle;
+
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hlen;
+	int file_size;
+
+	char *name = NULL;
+	char *type = NULL;
+
+	log_debug("%s()", __FUNCTION__);
+
+	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
+		switch(hi)	{
+		case OBEX_HDR_NAME:
+			log_debug("%s() Found name", __FUNCTION__);
+			if( (name = malloc(hlen / 2)))	{
+				OBEX_UnicodeToChar((uint8_t*)name, hv.bs, hlen);
+				log_debug("name:%s", name);
+			}
+			break;
+			
+		case OBEX_HDR_TYPE:
+			if( (type = malloc(hlen + 1)))	{
+				strcpy(type, (char *)hv.bs);
+			}
+			log_debug("%s() type:%s", __FUNCTION__, type);
+
+		case 0xbe: // user-defined inverse push
+			log_debug("%s() Found inverse push req", __FUNCTION__);
+       			log_debug("data:%02x", hv.bq1);
+			break;
+			
+
+		case OBEX_HDR_APPARAM:
+			log_debug("%s() Found apparam", __FUNCTION__);
+       			log_debug("name:%d (%02x %02x ...)", hlen, *hv.bs, *(hv.bs+1));
+			break;
+			
+		default:
+			log_debug("%s() Skipped header %02x", __FUNCTION__, hi);
+		}
+	}
+
+	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
+	if (is_type_fl(type))
+	{
+		struct rawdata_stream	*xmldata;
+		int			fd;
+
+		end_get(session);
+		fstat(session->dirfd, &session->list_stat);
+
+		session->list_doc = listing_cache_get(&session->list_stat);
+		if (session->list_doc) {
+			metrics.listing_cache_hits++;
+			log_info("Sending cached listing");
+			session->list_pos = 0;
+			OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+			hv.bs = NULL;
+			OBEX_ObjectAddHeader(handle, object, OBEX_HDR_BODY, hv, 0, OBEX_FL_STREAM_START);
+			goto out;
+		}
+
+		metrics.listing_cache_misses++;
+		session->list_build_us = 0;
+		xmldata = INIT_RAWDATA_STREAM(LIST_CHUNK + 512);
+		if (NULL == xmldata)
+			goto out;
+
+		FL_XML_VERSION(xmldata);
+		FL_XML_TYPE(xmldata);
+		FL_XML_BODY_BEGIN(xmldata);
+
+		/* watch before reading, changes meanwhile spoil the copy */
+		session->list_slot = listing_cache_reserve(session, &session->list_stat, &session->list_gen);
+		if (session->list_slot >= 0)
+			session->list_build = INIT_RAWDATA_STREAM(LIST_CHUNK);
+
+		/* a fresh fd, a dup would share the read position */
+		fd = openat(session->dirfd, ".", O_RDONLY | O_DIRECTORY);
+		session->list_dir = fd < 0 ? NULL : fdopendir(fd);
+		if (NULL == session->list_dir && fd >= 0)
+			close(fd);
+		session->list_data = xmldata;
+		session->list_flushed = 0;
+
+		/* entries are added in batches on OBEX_EV_STREAMEMPTY */
+		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		hv.bs = NULL;
+		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_BODY, hv, 0, OBEX_FL_STREAM_START);
+	}
+	else if (name)
+	{
+		char *path;
+		const char *base;
+		int dirfd = -1;
+
+		log_debug("%s() Got a request for %s", __FUNCTION__, name);
+		
+		if (session->stream_chunk == NULL)
+			session->stream_chunk = malloc(STREAM_CHUNK);
+		if (session->stream_next == NULL)
+			session->stream_next = malloc(STREAM_CHUNK);
+		end_get(session);
+
+		path = join_path(session->cwd, name);
+		if (path)
+			dirfd = session_parent(session, path, &base);
+		if (dirfd >= 0 && session->stream_chunk && session->stream_next)
+			session->get_fd = open_file(dirfd, base, &file_size);
+		free(path);
+		if(session->get_fd < 0) {
+			log_info("Can't find file %s", name);
+			OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
+			goto out;
+		}
+		map_file(session, file_size);
+		if (session->get_map == NULL) {
+			session->read_offset = 0;
+			get_read_ahead(session);
+		}
+
+		/* the body is read in chunks on OBEX_EV_STREAMEMPTY */
+		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		hv.bq4 = file_size;
+		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_LENGTH, hv, sizeof(uint32_t), 0);
+		hv.bs = NULL;
+		OBEX_ObjectAddHeader(handle, object, OBEX_HDR_BODY, hv, 0, OBEX_FL_STREAM_START);
+	}
+	else
+	{
+		log_debug("%s() Got a GET without a name-header!", __FUNCTION__);
+		OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
+		return;
+	}
+out:
+	if (NULL != name)
+	{
+		free(name);
+	}
+	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
+	if (NULL != type)
+	{
+		free(type);
+	}
+	//fprintf(stderr, "%s:%d:%s\n", __FILE__, __LINE__, __FUNCTION__);
+	
+	return;
+}
+
+/*
+ * Function put_target()
+ *
+ *    The name a PUT is saved as: the path is removed, uploads go
+ *    to the current directory.
+ *
+ */
+static const char *put_target(const char *name)
+{
+	const char *s;
+
+	s = strrchr(name, '/');
+	if (s == NULL)
+		s = name;
+	else
+		s++;
+
+	if (!*s || !strcmp(s, ".") || !strcmp(s, ".."))
+		return NULL;
+	return s;
+}
+
+/*
+ * Function end_put()
+ *
+ *    Drop the temp file of an unfinished PUT
+ *
+ */
+static void end_put(struct obexftpd_session *session)
+{
+	/* writes behind still use put_fd */
+	io_wait(session, 0);
+	if (session->put_fd >= 0) {
+		close(session->put_fd);
+		session->put_fd = -1;
+	}
+	if (session->put_tmp) {
+		(void) unlinkat(session->dirfd, session->put_tmp, 0);
+		free(session->put_tmp);
+		session->put_tmp = NULL;
+	}
+	session->put_error = 0;
+	session->put_offset = 0;
+}
+
+/* a new temp file in dirfd, same directory as the target so it can be linked into place */
+static int open_temp(int dirfd, char **name)
+{
+	static unsigned int serial = 0;
+	char tmp[64];
+	int tries, fd = -1;
+
+	for (tries = 0; tries < 100; tries++) {
+		snprintf(tmp, sizeof(tmp), PUT_TEMP_PREFIX "%ld-%u.part", (long) getpid(), serial++);
+		fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL,
+			    S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (fd < 0)
+		return -1;
+
+	*name = strdup(tmp);
+	if (*name == NULL) {
+		close(fd);
+		(void) unlinkat(dirfd, tmp, 0);
+		errno = ENOMEM;
+		return -1;
+	}
+	return fd;
+}
+
+static int put_open_temp(struct obexftpd_session *session)
+{
+	session->put_fd = open_temp(session->dirfd, &session->put_tmp);
+	if (session->put_fd < 0)
+		return -1;
+	if (blob_fd >= 0)
+		sha256_init(&session->put_hash);
+	return 0;
+}
+
+static uint8_t put_error_rsp(int error)
+{
+	switch (error) {
+	case ENOSPC:
+#ifdef EDQUOT
+	case EDQUOT:
+#endif
+		return OBEX_RSP_DATABASE_FULL;
+	case EEXIST:
+	case EACCES:
+	case EPERM:
+	case EROFS:
+		return OBEX_RSP_FORBIDDEN;
+	default:
+		return OBEX_RSP_INTERNAL_SERVER_ERROR;
+	}
+}
+
+static void put_write_done(struct io_job *job)
+{
+	struct obexftpd_session *session = job->session;
+
+	if (job->result < 0 && !session->put_error) {
+		session->put_error = job->error;
+		errno = job->error;
+		log_errno(LVL_ERROR, "write failed");
+	}
+	free(job->buf);
+}
+
+/*
+ * Function put_readstream()
+ *
+ *    Append the body data that just came in to the temp file.
+ *    It is copied and written behind by the I/O workers.
+ *
+ */
+static void put_readstream(struct obexftpd_session *session, obex_object_t *object)
+{
+	const uint8_t *buf;
+	struct io_job *job;
+	uint8_t *copy;
+	int len;
+
+	len = OBEX_ObjectReadStream(session->handle, object, &buf);
+	if (len < 0 || session->put_error)
+		return;
+	session->sched_bytes += len;
+	metrics.bytes_in += len;
+
+	if (session->put_fd < 0 && session->put_tmp == NULL && put_open_temp(session) < 0) {
+		session->put_error = errno;
+		log_errno(LVL_ERROR, "can't create temp file");
+	}
+
+	if (len > 0 && !session->put_error) {
+		/* the client outrunning the disk waits here */
+		io_wait(session, PUT_MAX_INFLIGHT - 1);
+		copy = malloc(len);
+		job = copy ? io_job_new(session, IO_WRITE, session->put_fd, copy, len,
+					session->put_offset, put_write_done) : NULL;
+		if (job == NULL) {
+			free(copy);
+			session->put_error = ENOMEM;
+		} else {
+			memcpy(copy, buf, len);
+			session->put_offset += len;
+			if (blob_fd >= 0)
+				sha256_update(&session->put_hash, buf, len);
+			io_submit(job);
+		}
+	}
+
+	if (session->put_error) {
+		/* tell the client now instead of taking the rest */
+		uint8_t rsp = put_error_rsp(session->put_error);
+		OBEX_ObjectSetRsp(object, rsp, rsp);
+	}
+}
+
+/*
+ * Function put_commit()
+ *
+ *    Give the temp file its name, now or with the next group
+ *    commit, which answers object. Existing files are not replaced.
+ *
+ */
+static int put_commit(struct obexftpd_session *session, obex_object_t *object, const char *target)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char blob[BLOB_NAME_SIZE];
+	int err;
+
+	if (blob_fd >= 0) {
+		sha256_final(&session->put_hash, digest);
+		blob_name(digest, blob);
+		blob_tag(session->put_fd, digest);
+		/* all names of a blob share it */
+		(void) fchmod(session->put_fd, S_IRUSR|S_IRGRP|S_IROTH);
+	}
+
+	if (sync_mode == SYNC_GROUP) {
+		err = sync_defer(session, object, target, blob_fd >= 0 ? blob : NULL);
+		if (err <= 0)
+			return err;
+	}
+
+	if (sync_mode != SYNC_NONE && fsync(session->put_fd) < 0) {
+		err = errno;
+		close(session->put_fd);
+		session->put_fd = -1;
+		errno = err;
+		return -1;
+	}
+	if (close(session->put_fd) < 0) {
+		session->put_fd = -1;
+		return -1;
+	}
+	session->put_fd = -1;
+
+	if (commit_file(session->dirfd, session->put_tmp, target, blob_fd >= 0 ? blob : NULL) < 0)
+		return -1;
+	/* the new name has to be on disk too */
+	if (sync_mode != SYNC_NONE && fsync(session->dirfd) < 0)
+		log_errno(LVL_WARN, "fsync");
+	listing_cache_forget(session->dirfd);
+
+	free(session->put_tmp);
+	session->put_tmp = NULL;
+	return 0;
+}
+
+
+/*
+ * Function put_done()
+ *
+ *    Parse the headers we got from a PUT so far, the body is
+ *    streamed to a temp file by put_readstream(). The final
+ *    call saves or deletes the file.
+ *
+ */
+static void put_done(struct obexftpd_session *session, obex_object_t *object, int final)
+{
+	obex_t *handle = session->handle;
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hlen;
+
+	char *name = session->put_name;
+	const char *target;
+	struct stat statbuf;
+
+	log_debug("put_done>>>");
+	while(OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen))	{
+		switch(hi)	{
+		case OBEX_HDR_NAME:
+			if (NULL != name)
+			{
+				free(name);
+			}
+			if( (name = malloc(hlen / 2)))	{
+				OBEX_UnicodeToChar((uint8_t *)name, hv.bs, hlen);
+				log_debug("put file name: %s", name);
+			}
+			break;
+
+		case OBEX_HDR_LENGTH:
+			log_debug("HEADER_LENGTH = %d", hv.bq4);
+			break;
+
+		case HDR_CREATOR:
+			log_debug("CREATORID = %#x", hv.bq4);
+			break;
+		
+		default:
+			log_debug("%s () Skipped header %02x", __FUNCTION__ , hi);
+		}
+	}
+	session->put_name = name;
+	if (!final)
+		return;
+
+	if(!name)	{
+		name = strdup("OBEX_PUT_Unknown_object");
+		log_debug("Got a PUT without a name. Setting name to %s", name);
+	}
+	/* all of the body has to be on disk */
+	io_wait(session, 0);
+	if (session->put_error) {
+		uint8_t rsp = put_error_rsp(session->put_error);
+		OBEX_ObjectSetRsp(object, rsp, rsp);
+	}
+	else if (session->put_tmp) {
+		target = name ? put_target(name) : NULL;
+		if (target == NULL) {
+			OBEX_ObjectSetRsp(object, OBEX_RSP_FORBIDDEN, OBEX_RSP_FORBIDDEN);
+		} else if (put_commit(session, object, target) < 0) {
+			uint8_t rsp = put_error_rsp(errno);
+			log_errno(LVL_ERROR, target);
+			OBEX_ObjectSetRsp(object, rsp, rsp);
+		} else if (!session->committing)
+			log_info("Wrote %s", target);
+	}
+	else if (name) {
+		/* a PUT without a body deletes */
+		char *path = join_path(session->cwd, name);
+		const char *base = "";
+		int dirfd = -1;
+
+		log_debug("Got a PUT without a body");
+		if (path)
+			dirfd = session_parent(session, path, &base);
+		if (dirfd < 0 || !*base || fstatat(dirfd, base, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			log_errno(LVL_INFO, "stat failed");
+			OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
+		} else if (S_ISDIR(statbuf.st_mode)) {
+			log_info("Removing dir %s", name);
+			session_forget_dir(session, path);
+			if (unlinkat(dirfd, base, AT_REMOVEDIR) < 0)
+				OBEX_ObjectSetRsp(object, OBEX_RSP_FORBIDDEN, OBEX_RSP_FORBIDDEN);
+		} else {
+			char blob[BLOB_NAME_SIZE];
+			int stored = blob_lookup(dirfd, base, &statbuf, blob) == 0;
+
+			log_info("Deleting file %s", name);
+			if (unlinkat(dirfd, base, 0) < 0)
+				OBEX_ObjectSetRsp(object, OBEX_RSP_FORBIDDEN, OBEX_RSP_FORBIDDEN);
+			else if (stored)
+				blob_release(blob);
+		}
+		if (dirfd >= 0)
+			listing_cache_forget(dirfd);
+		free(path);
+	}
+
+	end_put(session);
+	free(name);
+	session->put_name = NULL;
+	log_debug("<<<put_done");
+}
+
+
+/*
+ * Function copy_data()
+ *
+ *    Copy all of in to out, hashing it with --dedup. The kernel may
+ *    share the blocks, e.g. on btrfs or XFS.
+ *
+ */
+static int copy_data(int in, int out, struct sha256_ctx *hash)
+{
+	uint8_t buf[65536];
+	ssize_t n, done, ret;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (hash == NULL) {
+		while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+			;
+		if (n == 0)
+			return 0;
+		/* not across these file systems, go on by hand */
+		if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+			return -1;
+	}
+#endif
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (hash)
+			sha256_update(hash, buf, n);
+		for (done = 0; done < n; done += ret) {
+			ret = write(out, buf + done, n - done);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function action_copy()
+ *
+ *    Copy a file through a temp file next to the target, which is
+ *    committed like an upload. Existing files are not replaced.
+ *
+ */
+static int action_copy(int src_dirfd, const char *src, int dst_dirfd, const char *dst)
+{
+	struct sha256_ctx hash;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char blob[BLOB_NAME_SIZE];
+	struct stat statbuf;
+	char *tmp = NULL;
+	int in, out, err;
+
+	in = openat(src_dirfd, src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	if (fstat(in, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+		close(in);
+		errno = EPERM;
+		return -1;
+	}
+	out = open_temp(dst_dirfd, &tmp);
+	if (out < 0) {
+		err = errno;
+		close(in);
+		errno = err;
+		return -1;
+	}
+
+	if (blob_fd >= 0)
+		sha256_init(&hash);
+	if (copy_data(in, out, blob_fd >= 0 ? &hash : NULL) < 0)
+		goto err;
+	if (blob_fd >= 0) {
+		sha256_final(&hash, digest);
+		blob_name(digest, blob);
+		blob_tag(out, digest);
+	}
+	if (fchmod(out, blob_fd >= 0 ? S_IRUSR|S_IRGRP|S_IROTH : statbuf.st_mode & 0777) < 0 ||
+	    (sync_mode != SYNC_NONE && fsync(out) < 0))
+		goto err;
+	close(in);
+	in = -1;
+	if (close(out) < 0) {
+		out = -1;
+		goto err;
+	}
+	out = -1;
+
+	if (commit_file(dst_dirfd, tmp, dst, blob_fd >= 0 ? blob : NULL) < 0)
+		goto err;
+	if (sync_mode != SYNC_NONE && fsync(dst_dirfd) < 0)
+		log_errno(LVL_WARN, "fsync");
+	free(tmp);
+	return 0;
+
+err:
+	err = errno;
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	(void) unlinkat(dst_dirfd, tmp, 0);
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+/* rename without replacing dst */
+static int action_move(int src_dirfd, const char *src, int dst_dirfd, const char *dst)
+{
+	struct stat statbuf;
+
+#ifdef HAVE_RENAMEAT2
+	if (renameat2(src_dirfd, src, dst_dirfd, dst, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+#endif
+	if (fstatat(dst_dirfd, dst, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	return renameat(src_dirfd, src, dst_dirfd, dst);
+}
+
+/*
+ * Function action_setperm()
+ *
+ *    Map the read and write bits of OBEX permissions to the mode.
+ *    Folders are searchable when readable, files keep their x bits.
+ *    Deduplicated files share their inode with other names and are
+ *    refused.
+ *
+ */
+static int action_setperm(int dirfd, const char *name, uint32_t perms)
+{
+	static const mode_t r[3] = { S_IROTH, S_IRGRP, S_IRUSR };
+	static const mode_t w[3] = { S_IWOTH, S_IWGRP, S_IWUSR };
+	static const mode_t x[3] = { S_IXOTH, S_IXGRP, S_IXUSR };
+	struct stat statbuf;
+	mode_t mode;
+	int i;
+
+	if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	if (!S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode)) {
+		errno = EPERM;
+		return -1;
+	}
+	/* the mode would change every other name of the blob too */
+	if (blob_fd >= 0 && S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1) {
+		errno = EPERM;
+		return -1;
+	}
+
+	mode = S_ISDIR(statbuf.st_mode) ? 0 : statbuf.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH);
+	for (i = 0; i < 3; i++) {
+		uint8_t bits = perms >> (8 * i);
+
+		if (bits & OBEXFTP_PERM_READ)
+			mode |= r[i] | (S_ISDIR(statbuf.st_mode) ? x[i] : 0);
+		if (bits & OBEXFTP_PERM_WRITE)
+			mode |= w[i];
+	}
+	return fchmodat(dirfd, name, mode, 0);
+}
+
+/*
+ * Function action_server()
+ *
+ *    Copy, move or set permissions (OBEX 1.5 ACTION), so clients
+ *    don't have to send a file back and forth for that.
+ *
+ */
+static void action_server(struct obexftpd_session *session, obex_object_t *object)
+{
+	obex_t *handle = session->handle;
+	obex_headerdata_t hv;
+	uint8_t hi;
+	uint32_t hlen;
+
+	char *name = NULL, *dest = NULL;
+	char *src_path = NULL, *dst_path = NULL;
+	const char *src_base = "", *dst_base = "";
+	int src_dirfd = -1, dst_dirfd = -1;
+	int action = -1, ret = -1;
+	int have_perms = 0;
+	uint32_t perms = 0;
+	uint8_t rsp;
+
+	while (OBEX_ObjectGetNextHeader(handle, object, &hi, &hv, &hlen)) {
+		switch (hi) {
+		case OBEX_HDR_ACTION_ID:
+			action = hv.bq1;
+			break;
+		case OBEX_HDR_NAME:
+			free(name);
+			if ((name = malloc(hlen / 2 + 1)))
+				OBEX_UnicodeToChar((uint8_t *)name, hv.bs, hlen);
+			break;
+		case OBEX_HDR_DESTNAME:
+			free(dest);
+			if ((dest = malloc(hlen / 2 + 1)))
+				OBEX_UnicodeToChar((uint8_t *)dest, hv.bs, hlen);
+			break;
+		case OBEX_HDR_PERMISSIONS:
+			perms = hv.bq4;
+			have_perms = 1;
+			break;
+		default:
+			log_debug("%s () Skipped header %02x", __FUNCTION__ , hi);
+		}
+	}
+
+	if (name == NULL || (action != OBEXFTP_ACTION_SETPERM && dest == NULL) ||
+	    (action == OBEXFTP_ACTION_SETPERM && !have_perms) ||
+	    action < OBEXFTP_ACTION_COPY || action > OBEXFTP_ACTION_SETPERM) {
+		OBEX_ObjectSetRsp(object, OBEX_RSP_BAD_REQUEST, OBEX_RSP_BAD_REQUEST);
+		goto out;
+	}
+
+	src_path = join_path(session->cwd, name);
+	if (src_path)
+		src_dirfd = session_parent(session, src_path, &src_base);
+	if (dest) {
+		dst_path = join_path(session->cwd, dest);
+		if (dst_path)
+			dst_dirfd = session_parent(session, dst_path, &dst_base);
+	}
+	if (src_dirfd < 0 || !*src_base || (dest && (dst_dirfd < 0 || put_target(dst_base) == NULL))) {
+		OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_FOUND, OBEX_RSP_NOT_FOUND);
+		goto out;
+	}
+
+	switch (action) {
+	case OBEXFTP_ACTION_COPY:
+		log_info("Copying %s to %s", src_path, dst_path);
+		ret = action_copy(src_dirfd, src_base, dst_dirfd, dst_base);
+		break;
+	case OBEXFTP_ACTION_MOVE:
+		log_info("Moving %s to %s", src_path, dst_path);
+		/* not into itself, dst_dirfd may be one of its cached fds */
+		if (path_below(dst_path, src_path)) {
+			OBEX_ObjectSetRsp(object, OBEX_RSP_FORBIDDEN, OBEX_RSP_FORBIDDEN);
+			goto out;
+		}
+		ret = action_move(src_dirfd, src_base, dst_dirfd, dst_base);
+		if (ret == 0) {
+			session_forget_dir(session, src_path);
+			listing_cache_forget(src_dirfd);
+			if (sync_mode != SYNC_NONE)
+				(void) fsync(src_dirfd);
+		}
+		break;
+	case OBEXFTP_ACTION_SETPERM:
+		log_info("Setting permissions of %s to %06x", src_path, perms);
+		ret = action_setperm(src_dirfd, src_base, perms);
+		break;
+	}
+	if (ret < 0) {
+		log_errno(LVL_INFO, name);
+		rsp = errno == ENOENT ? OBEX_RSP_NOT_FOUND : put_error_rsp(errno);
+		OBEX_ObjectSetRsp(object, rsp, rsp);
+	}
+	listing_cache_forget(dst_dirfd >= 0 ? dst_dirfd : src_dirfd);
+
+out:
+	free(name);
+	free(dest);
+	free(src_path);
+	free(dst_path);
+}
+
+
+/*
+ * Function server_indication()
+ *
+ * Called when a request is about to come or has come.
+ *
+ */
+static void server_request(struct obexftpd_session *session, obex_object_t *object, int UNUSED(event), int cmd)
+{
+	switch(cmd)	{
+	case OBEX_CMD_SETPATH:
+		log_debug("Received SETPATH command");
+		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		set_server_path(session, object);
+		break;
+	case OBEX_CMD_GET:
+		/* A Get always fits one package */
+		get_server(session, object);
+		break;
+	case OBEX_CMD_PUT:
+		log_debug("Received PUT command");
+		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		put_done(session, object, 1);
+		break;
+	case OBEX_CMD_ACTION:
+		log_debug("Received ACTION command");
+		OBEX_ObjectSetRsp(object, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		action_server(session, object);
+		break;
+	case OBEX_CMD_CONNECT:
+//		OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
+		connect_server(session, object);
+		break;
+	case OBEX_CMD_DISCONNECT:
+		OBEX_ObjectSetRsp(object, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
+		break;
+	default:
+		log_debug("%s () Denied %02x request", __FUNCTION__, cmd);
+		OBEX_ObjectSetRsp(object, OBEX_RSP_NOT_IMPLEMENTED, OBEX_RSP_NOT_IMPLEMENTED);
+		break;
+	}
+	return;
+}
+
+
+//BEGIN of session handling
+static void set_response_mode(obex_t *handle)
+{
+	/* in single response mode a GET response goes on without input,
+	   only OBEX_Work() sends it from the event loop */
+#if defined(HAVE_OBEX_SETREPONSEMODE) && defined(HAVE_OBEX_WORK)
+	/* clients that don't send the SRM header still get classic mode */
+	if (use_srm)
+		OBEX_SetReponseMode(handle, OBEX_RSP_MODE_SINGLE);
+#else
+	(void) handle;
+#endif
+}
+
+static void obex_event(obex_t *handle, obex_object_t *obj, int mode, int event, int obex_cmd, int obex_rsp);
+static int loop_add(int fd, struct obexftpd_session *session);
+static void loop_del(int fd);
+static void bucket_init(struct token_bucket *bucket, long rate);
+static void listener_accepted(void);
+static void sched_remove(struct obexftpd_session *session);
+
+/*
+ * Function accept_session()
+ *
+ *    Take over a connection the listener just accepted
+ *
+ */
+/* set up a session whose handle is connected, freeing it on failure */
+static void add_session(struct obexftpd_session *session)
+{
+	set_response_mode(session->handle);
+	session->fd = OBEX_GetFD(session->handle);
+	session->get_fd = -1;
+	session->put_fd = -1;
+	session->dirfd = root_fd;
+	bucket_init(&session->bucket, session_rate);
+	session->cwd = strdup("");
+	if (session->cwd == NULL || loop_add(session->fd, session) < 0) {
+		log_errno(LVL_ERROR, "failed to watch connection");
+		OBEX_Cleanup(session->handle);
+		if (session->own_fd)
+			close(session->fd);
+		free(session->cwd);
+		free(session);
+		return;
+	}
+
+	session->next = sessions;
+	sessions = session;
+	session_count++;
+	metrics.accepted++;
+	log_info("Accepted connection on fd %d (%d open)", session->fd, session_count);
+}
+
+static void accept_session(obex_t *listener)
+{
+	struct obexftpd_session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL) {
+		log_error("out of memory, dropping connection");
+		(void) OBEX_TransportDisconnect(listener);
+		return;
+	}
+
+	session->handle = OBEX_ServerAccept(listener, obex_event, session);
+	if (session->handle == NULL) {
+		/* the listener still holds the link, drop it */
+		log_error("failed to accept connection");
+		free(session);
+		(void) OBEX_TransportDisconnect(listener);
+		return;
+	}
+	add_session(session);
+	listener_accepted();
+}
+
+/*
+ * Function accept_fd_session()
+ *
+ *    Serve a TCP connection a worker accepted itself, OpenOBEX
+ *    just reads and writes the fd
+ *
+ */
+static void accept_fd_session(int fd)
+{
+	struct obexftpd_session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL) {
+		log_error("out of memory, dropping connection");
+		close(fd);
+		return;
+	}
+
+	session->handle = OBEX_Init(OBEX_TRANS_FD, obex_event, 0);
+	if (session->handle == NULL || FdOBEX_TransportSetup(session->handle, fd, fd, 0) < 0) {
+		log_error("failed to accept connection");
+		if (session->handle)
+			OBEX_Cleanup(session->handle);
+		close(fd);
+		free(session);
+		return;
+	}
+	OBEX_SetUserData(session->handle, session);
+	session->own_fd = 1;
+	add_session(session);
+}
+
+static void free_session(struct obexftpd_session *session)
+{
+	sched_remove(session);
+	sync_forget(session);
+	loop_del(session->fd);
+	OBEX_Cleanup(session->handle);
+	if (session->own_fd)
+		close(session->fd);
+	end_get(session);
+	end_put(session);
+	session_free_dirs(session);
+	free(session->stream_chunk);
+	free(session->stream_next);
+	free(session->put_name);
+	free(session);
+	session_count--;
+}
+
+/*
+ * Function reap_sessions()
+ *
+ *    Free all sessions whose link went down. Not done from within
+ *    the event callback as the handle is still in use there.
+ *
+ */
+static void reap_sessions(int all)
+{
+	struct obexftpd_session **sp = &sessions;
+	struct obexftpd_session *session;
+
+	while ((session = *sp) != NULL) {
+		if (session->finished || all) {
+			*sp = session->next;
+			log_info("Closing connection on fd %d", session->fd);
+			free_session(session);
+		} else
+			sp = &session->next;
+	}
+}
+//END of session handling
+
+
+static void obex_event(obex_t *handle, obex_object_t *obj, int mode, int event, int obex_cmd, int obex_rsp)
+{
+	struct obexftpd_session *session = OBEX_GetUserData(handle);
+	int sent;
+
+	/* the listener only ever sees connection attempts and link errors */
+	if (session == NULL) {
+		switch (event) {
+		case OBEX_EV_ACCEPTHINT:
+			accept_session(handle);
+			break;
+		case OBEX_EV_LINKERR:
+			/* of a link it didn't hand over, it keeps listening */
+			log_warn("link of the listener failed");
+			break;
+		default:
+			log_debug("%s() Unhandled listener event %d", __func__, event);
+			break;
+		}
+		return;
+	}
+
+	switch (event) {
+	case OBEX_EV_STREAMAVAIL:
+		put_readstream(session, obj);
+		break;
+
+	case OBEX_EV_LINKERR:
+        end_get(session);
+        end_put(session);
+        session->finished = 1;
+        session->success = FALSE;
+		log_warn("failed: %d", obex_cmd);
+		break;
+
+    	case OBEX_EV_REQ:
+        log_debug("Incoming request %02x", obex_cmd);
+		/* Comes when a server-request has been received. */
+		server_request(session, obj, event, obex_cmd);
+		break;
+		
+	case OBEX_EV_REQHINT:
+        /* An incoming request is about to come. Accept it! */
+		metrics.requests[metrics_op(obex_cmd)]++;
+		session->req_start = now_us();
+		session_check_cwd(session);
+		switch(obex_cmd) {
+		case OBEX_CMD_PUT:
+			/* have the body delivered by OBEX_EV_STREAMAVAIL */
+			OBEX_ObjectReadStream(handle, obj, NULL);
+			end_put(session);
+			OBEX_ObjectSetRsp(obj, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+			break;
+		case OBEX_CMD_CONNECT:
+		case OBEX_CMD_DISCONNECT:
+		case OBEX_CMD_ACTION:
+			OBEX_ObjectSetRsp(obj, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+			break;
+		default:
+			OBEX_ObjectSetRsp(obj, OBEX_RSP_NOT_IMPLEMENTED, OBEX_RSP_NOT_IMPLEMENTED);
+			break;
+		}
+		break;
+
+	case OBEX_EV_REQCHECK:
+		/* e.g. mode=01, obex_cmd=03, obex_rsp=00 */
+            	log_debug("%s() OBEX_EV_REQCHECK: mode=%02x, obex_cmd=%02x, obex_rsp=%02x", __func__, 
+				mode, obex_cmd, obex_rsp);
+		OBEX_ObjectSetRsp(obj, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+		break;
+	case OBEX_EV_REQDONE:
+		end_get(session);
+		end_put(session);
+		metrics.responses[obex_rsp & 0x7f]++;
+		if (session->req_start) {
+			hist_observe(&metrics.latency[metrics_op(obex_cmd)],
+				     now_us() - session->req_start);
+			session->req_start = 0;
+		}
+        	if(obex_rsp == OBEX_RSP_SUCCESS)
+	        	session->success = TRUE;
+        	else {
+	            session->success = FALSE;
+        	    log_debug("%s() OBEX_EV_REQDONE: obex_rsp=%02x", __func__, obex_rsp);
+	        }
+		/* the client is going away, don't wait for it to hang up */
+		if (obex_cmd == OBEX_CMD_DISCONNECT)
+			session->finished = 1;
+		break;
+
+	case OBEX_EV_PROGRESS:
+		switch(obex_cmd) {
+		case OBEX_CMD_PUT:
+			log_debug("obex_ev_progress: obex_cmd_put");
+			put_done(session, obj, 0);
+			break;
+		default:
+			break;
+		}
+		break;
+	case OBEX_EV_ABORT:
+		/* Request was aborted */
+            	log_debug("%s() OBEX_EV_ABORT: mode=%02x, obex_cmd=%02x, obex_rsp=%02x", __func__, 
+				mode, obex_cmd, obex_rsp);
+		end_get(session);
+		end_put(session);
+		metrics.aborted[metrics_op(obex_cmd)]++;
+		session->req_start = 0;
+		break;
+
+	case OBEX_EV_STREAMEMPTY:
+		if (session->list_doc)
+			sent = doc_fillstream(session, obj);
+		else if (session->list_data)
+			sent = list_fillstream(session, obj);
+		else
+			sent = get_fillstream(session, obj);
+		if (sent > 0) {
+			session->sched_bytes += sent;
+			metrics.bytes_out += sent;
+		}
+		break;
+
+	case OBEX_EV_UNEXPECTED:
+		/* Unexpected data, not fatal */
+		break;
+    default:
+         log_debug("%s() Unhandled event %d", __func__, event);
+         break;
+
+	}
+}
+
+
+//BEGIN of the event loop
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
+static obex_t *listener = NULL;
+static int listen_fd = -1;
+static int listen_paused = 0;
+
+static int loop_init(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (epoll_fd < 0)
+		epoll_fd = epoll_create(MAX_EVENTS);
+	return epoll_fd;
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* what a session waits for, input or room to send */
+static uint32_t loop_events(struct obexftpd_session *session)
+{
+	if (session && (session->paused || session->committing))
+		return 0;
+	if (session && session->sending)
+		return EPOLLOUT;
+	return EPOLLIN;
+}
+#endif
+
+/* watch fd for input, session is NULL for the listener */
+static int loop_add(int fd, struct obexftpd_session *session)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = loop_events(session);
+	ev.data.ptr = session;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+	(void) session;
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+static void loop_del(int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev; /* kernels before 2.6.9 want one */
+
+	(void) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+#else
+	(void) fd;
+#endif
+}
+
+/* stop or resume watching fd, session is NULL for the listener */
+static void loop_pause(int fd, struct obexftpd_session *session, int paused)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
+
+	if (session)
+		session->paused = paused;
+	else
+		listen_paused = paused;
+#ifdef HAVE_SYS_EPOLL_H
+	memset(&ev, 0, sizeof(ev));
+	ev.events = paused ? 0 : loop_events(session);
+	ev.data.ptr = session;
+	(void) epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+#endif
+}
+
+/*
+ * Function loop_work()
+ *
+ *    Let OpenOBEX handle the input of a session, or send what it has
+ *    queued. In single response mode a GET response goes on without
+ *    any input, so while OpenOBEX has data out the session is watched
+ *    for room to send instead.
+ *
+ */
+static int loop_work(struct obexftpd_session *session)
+{
+	int ret;
+#ifdef HAVE_OBEX_WORK
+	int sending = session->sending;
+
+	if (sending)
+		ret = OBEX_Work(session->handle);
+	else
+		ret = OBEX_HandleInput(session->handle, 0);
+	session->sending = ret >= 0 &&
+		OBEX_GetDataDirection(session->handle) == OBEX_DATA_OUT;
+	if (session->sending != sending && !session->paused)
+		loop_pause(session->fd, session, 0);
+#else
+	ret = OBEX_HandleInput(session->handle, 0);
+#endif
+	return ret;
+}
+
+/*
+ * Function loop_suspend()
+ *
+ *    Hold the response to the request in object back, the session
+ *    isn't watched until loop_resume() lets it go out
+ *
+ */
+static int loop_suspend(struct obexftpd_session *session, obex_object_t *object)
+{
+	if (OBEX_SuspendRequest(session->handle, object) < 0)
+		return -1;
+	session->committing = 1;
+	loop_pause(session->fd, session, session->paused);
+	return 0;
+}
+
+static void loop_resume(struct obexftpd_session *session)
+{
+	session->committing = 0;
+	(void) OBEX_ResumeRequest(session->handle);
+#ifdef HAVE_OBEX_WORK
+	/* the response may be left for OBEX_Work() to send */
+	session->sending = OBEX_GetDataDirection(session->handle) == OBEX_DATA_OUT;
+#endif
+	loop_pause(session->fd, session, 0);
+}
+
+/*
+ * Function loop_wait()
+ *
+ *    Wait up to timeout ms for input, or room to send. Fills ready
+ *    with the sessions that are ready, NULL standing for the listener.
+ *
+ */
+static int loop_wait(struct obexftpd_session **ready, int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+	for (i = 0; i < n; i++)
+		ready[i] = events[i].data.ptr;
+	return n;
+#else
+	struct obexftpd_session *session;
+	struct timeval tv;
+	fd_set fds, wfds;
+	int maxfd = listen_fd;
+	int n;
+
+	FD_ZERO(&fds);
+	FD_ZERO(&wfds);
+	if (listen_fd >= 0 && !listen_paused)
+		FD_SET(listen_fd, &fds);
+	for (session = sessions; session; session = session->next) {
+		if (session->paused || session->committing)
+			continue;
+		FD_SET(session->fd, session->sending ? &wfds : &fds);
+		if (session->fd > maxfd)
+			maxfd = session->fd;
+	}
+	for (session = services; session; session = session->next) {
+		if (session->paused)
+			continue;
+		FD_SET(session->fd, session->sending ? &wfds : &fds);
+		if (session->fd > maxfd)
+			maxfd = session->fd;
+	}
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	n = select(maxfd + 1, &fds, &wfds, NULL, &tv);
+	if (n <= 0)
+		return n;
+
+	n = 0;
+	if (listen_fd >= 0 && !listen_paused && FD_ISSET(listen_fd, &fds))
+		ready[n++] = NULL;
+	for (session = sessions; session && n < MAX_EVENTS; session = session->next)
+		if (!session->paused && !session->committing &&
+		    FD_ISSET(session->fd, session->sending ? &wfds : &fds))
+			ready[n++] = session;
+	for (session = services; session && n < MAX_EVENTS; session = session->next)
+		if (!session->paused && FD_ISSET(session->fd, session->sending ? &wfds : &fds))
+			ready[n++] = session;
+	return n;
+#endif
+}
+
+/*
+ * Function add_service()
+ *
+ *    Have the event loop call input whenever fd is readable, or
+ *    writable while the service is sending
+ *
+ */
+static int add_service(int fd, void (*input)(struct obexftpd_session *session))
+{
+	struct obexftpd_session *service;
+
+	service = calloc(1, sizeof(*service));
+	if (service == NULL)
+		return -1;
+	service->fd = fd;
+	service->input = input;
+	if (loop_add(fd, service) < 0) {
+		free(service);
+		return -1;
+	}
+	service->next = services;
+	services = service;
+	return 0;
+}
+
+/* stop watching a service and close its fd */
+static void del_service(struct obexftpd_session *service)
+{
+	struct obexftpd_session **sp;
+
+	for (sp = &services; *sp; sp = &(*sp)->next)
+		if (*sp == service) {
+			*sp = service->next;
+			break;
+		}
+	loop_del(service->fd);
+	close(service->fd);
+	if (service->http_reply)
+		FREE_RAWDATA_STREAM(service->http_reply);
+	free(service);
+}
+
+static void free_services(void)
+{
+	struct obexftpd_session *service;
+
+	while ((service = services) != NULL) {
+		services = service->next;
+		loop_del(service->fd);
+		if (service->http_reply)
+			FREE_RAWDATA_STREAM(service->http_reply);
+		free(service);
+	}
+}
+//END of the event loop
+
+//BEGIN of scheduling
+/*
+ * Sessions with input, or with room to send a packet OpenOBEX has
+ * out, wait in a run queue served by deficit round robin: every pass
+ * adds sched_quantum bytes to a session's deficit, and it gets to
+ * handle a packet once that covers what its last one cost. So bulk
+ * transfers of large packets can't crowd out small requests. Token
+ * buckets cap the rate of each session and of all of them. A bucket
+ * may go negative, as the size of a packet is known only after it
+ * was handled; its sessions then wait for the refill. Sessions left
+ * waiting aren't watched by the event loop meanwhile.
+ */
+static struct token_bucket total_bucket;
+static long sched_quantum = SCHED_QUANTUM;
+static struct obexftpd_session *run_head = NULL, **run_tail = &run_head;
+
+static long long now_ms(void)
+{
+	return now_us() / 1000;
+}
+
+static void bucket_init(struct token_bucket *bucket, long rate)
+{
+	bucket->rate = rate;
+	/* a tenth of a second worth, but at least one large packet */
+	bucket->burst = rate / 10 > 65536 ? rate / 10 : 65536;
+	bucket->tokens = bucket->burst;
+	bucket->stamp = now_ms();
+}
+
+static void bucket_refill(struct token_bucket *bucket, long long now)
+{
+	long long add;
+
+	if (bucket->rate == 0)
+		return;
+	/* the stamp stays put until there is a whole token to add */
+	add = bucket->rate * (now - bucket->stamp) / 1000;
+	if (add <= 0)
+		return;
+	bucket->stamp = now;
+	if (bucket->tokens + add > bucket->burst)
+		bucket->tokens = bucket->burst;
+	else
+		bucket->tokens += add;
+}
+
+/* ms until the bucket is out of debt */
+static long bucket_wait(const struct token_bucket *bucket)
+{
+	if (bucket->rate == 0 || bucket->tokens >= 0)
+		return 0;
+	return (-bucket->tokens * 1000 + bucket->rate - 1) / bucket->rate;
+}
+
+static void sched_add(struct obexftpd_session *session)
+{
+	if (session->queued)
+		return;
+	session->queued = 1;
+	session->run_next = NULL;
+	*run_tail = session;
+	run_tail = &session->run_next;
+}
+
+static void sched_unlink(struct obexftpd_session **sp)
+{
+	struct obexftpd_session *session = *sp;
+
+	*sp = session->run_next;
+	if (run_tail == &session->run_next)
+		run_tail = sp;
+	session->queued = 0;
+}
+
+static void sched_remove(struct obexftpd_session *session)
+{
+	struct obexftpd_session **sp;
+
+	for (sp = &run_head; *sp; sp = &(*sp)->run_next)
+		if (*sp == session) {
+			sched_unlink(sp);
+			return;
+		}
+}
+
+/*
+ * Function sched_run()
+ *
+ *    One round over the run queue, handling a packet of each session
+ *    whose deficit and buckets allow it
+ *
+ */
+static void sched_run(void)
+{
+	struct obexftpd_session *session, **sp;
+	long long now = now_ms();
+	long cost;
+
+	bucket_refill(&total_bucket, now);
+	sp = &run_head;
+	while ((session = *sp) != NULL) {
+		if (session->finished) {
+			sched_unlink(sp);
+			continue;
+		}
+		bucket_refill(&session->bucket, now);
+		if (bucket_wait(&total_bucket) || bucket_wait(&session->bucket)) {
+			sp = &session->run_next;
+			continue;
+		}
+		session->deficit += sched_quantum;
+		if (session->deficit < session->last_cost) {
+			sp = &session->run_next;
+			continue;
+		}
+
+		sched_unlink(sp);
+		if (session->paused)
+			loop_pause(session->fd, session, 0);
+		session->sched_bytes = 0;
+		if (loop_work(session) < 0)
+			session->finished = 1;
+		if (session->get_truncated) {
+			/* zeros went out for the missing part, the client must not keep them */
+			log_error("file shrank while it was sent, dropping connection on fd %d", session->fd);
+			session->finished = 1;
+		}
+
+		cost = session->sched_bytes;
+		session->last_cost = cost;
+		session->deficit -= cost;
+		/* nothing is saved up while idle, debt is kept */
+		if (session->deficit > 0)
+			session->deficit = 0;
+		session->bucket.tokens -= cost;
+		if (total_bucket.rate)
+			total_bucket.tokens -= cost;
+	}
+
+	/* the rest is known to be ready, stop the loop reporting it */
+	for (session = run_head; session; session = session->run_next)
+		if (!session->paused)
+			loop_pause(session->fd, session, 1);
+}
+
+/* how long the event loop may wait, at most timeout ms */
+static int sched_timeout(int timeout)
+{
+	struct obexftpd_session *session;
+	long wait, total_wait;
+
+	if (run_head == NULL)
+		return timeout;
+	total_wait = bucket_wait(&total_bucket);
+	for (session = run_head; session; session = session->run_next) {
+		wait = bucket_wait(&session->bucket);
+		if (wait < total_wait)
+			wait = total_wait;
+		if (wait < timeout)
+			timeout = wait;
+	}
+	return timeout;
+}
+//END of scheduling
+
+//BEGIN of the metrics endpoint
+/*
+ * Scrapers connect to a Unix socket or a port on the loopback
+ * interface. Whatever they send is taken as a request for the lot.
+ */
+static char *metrics_addr = NULL;	/* a path, or a port */
+static char metrics_path[108];		/* the Unix socket to remove */
+static int metrics_fd = -1;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void metrics_line(struct rawdata_stream *out, const char *format, ...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	ADD_RAWDATA_STREAM_DATA(out, line);
+}
+
+static void metrics_histogram(struct rawdata_stream *out, const char *name,
+			      const char *label, const struct histogram *hist)
+{
+	unsigned long total = 0;
+	const char *sep = *label ? "," : "";
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += hist->count[i];
+		metrics_line(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, sep,
+			     hist_bounds[i] / 1e6, total);
+	}
+	total += hist->count[HIST_BUCKETS];
+	metrics_line(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, total);
+	if (*label) {
+		metrics_line(out, "%s_sum{%s} %.6f\n", name, label, hist->sum_us / 1e6);
+		metrics_line(out, "%s_count{%s} %lu\n", name, label, total);
+	} else {
+		metrics_line(out, "%s_sum %.6f\n", name, hist->sum_us / 1e6);
+		metrics_line(out, "%s_count %lu\n", name, total);
+	}
+}
+
+static struct rawdata_stream *metrics_render(void)
+{
+	struct rawdata_stream *out = INIT_RAWDATA_STREAM(8192);
+	char label[32];
+	int i;
+
+	if (out == NULL)
+		return NULL;
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_sessions Connections open.\n"
+		"# TYPE obexftpd_sessions gauge\n");
+	metrics_line(out, "obexftpd_sessions %d\n", session_count);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_sessions_accepted_total Connections accepted.\n"
+		"# TYPE obexftpd_sessions_accepted_total counter\n");
+	metrics_line(out, "obexftpd_sessions_accepted_total %lu\n", metrics.accepted);
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_requests_total Requests by opcode.\n"
+		"# TYPE obexftpd_requests_total counter\n");
+	for (i = 0; i < OP_COUNT; i++)
+		metrics_line(out, "obexftpd_requests_total{opcode=\"%s\"} %lu\n",
+			     op_names[i], metrics.requests[i]);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_requests_aborted_total Requests aborted by opcode.\n"
+		"# TYPE obexftpd_requests_aborted_total counter\n");
+	for (i = 0; i < OP_COUNT; i++)
+		metrics_line(out, "obexftpd_requests_aborted_total{opcode=\"%s\"} %lu\n",
+			     op_names[i], metrics.aborted[i]);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_responses_total Final responses by OBEX response code.\n"
+		"# TYPE obexftpd_responses_total counter\n");
+	for (i = 0; i < 0x80; i++)
+		if (metrics.responses[i])
+			metrics_line(out, "obexftpd_responses_total{code=\"0x%02x\"} %lu\n",
+				     i, metrics.responses[i]);
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_body_bytes_received_total Body bytes of PUTs.\n"
+		"# TYPE obexftpd_body_bytes_received_total counter\n");
+	metrics_line(out, "obexftpd_body_bytes_received_total %llu\n", metrics.bytes_in);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_body_bytes_sent_total Body bytes of GETs.\n"
+		"# TYPE obexftpd_body_bytes_sent_total counter\n");
+	metrics_line(out, "obexftpd_body_bytes_sent_total %llu\n", metrics.bytes_out);
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_request_duration_seconds From the first packet of a request to its response.\n"
+		"# TYPE obexftpd_request_duration_seconds histogram\n");
+	for (i = 0; i < OP_COUNT; i++) {
+		snprintf(label, sizeof(label), "opcode=\"%s\"", op_names[i]);
+		metrics_histogram(out, "obexftpd_request_duration_seconds", label, &metrics.latency[i]);
+	}
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_listing_cache_hits_total Folder listings sent from the cache.\n"
+		"# TYPE obexftpd_listing_cache_hits_total counter\n");
+	metrics_line(out, "obexftpd_listing_cache_hits_total %lu\n", metrics.listing_cache_hits);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_listing_cache_misses_total Folder listings read from the directory.\n"
+		"# TYPE obexftpd_listing_cache_misses_total counter\n");
+	metrics_line(out, "obexftpd_listing_cache_misses_total %lu\n", metrics.listing_cache_misses);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_listing_build_seconds Time spent reading a directory for a listing.\n"
+		"# TYPE obexftpd_listing_build_seconds histogram\n");
+	metrics_histogram(out, "obexftpd_listing_build_seconds", "", &metrics.listing_build);
+
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_io_wait_seconds Time the event loop blocked on file I/O.\n"
+		"# TYPE obexftpd_io_wait_seconds histogram\n");
+	metrics_histogram(out, "obexftpd_io_wait_seconds", "", &metrics.io_wait);
+	ADD_RAWDATA_STREAM_DATA(out,
+		"# HELP obexftpd_io_job_seconds Time a file read or write took.\n"
+		"# TYPE obexftpd_io_job_seconds histogram\n");
+	metrics_histogram(out, "obexftpd_io_job_seconds", "", &metrics.io_job);
+
+	return out;
+}
+
+/* send what the socket takes, the rest when there is room */
+static void metrics_send(struct obexftpd_session *conn)
+{
+	struct rawdata_stream *reply = conn->http_reply;
+	ssize_t n;
+
+	while (conn->http_sent < reply->size) {
+		n = send(conn->fd, reply->data + conn->http_sent, reply->size - conn->http_sent,
+			 MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (!conn->sending) {
+				conn->sending = 1;
+				loop_pause(conn->fd, conn, 0);
+			}
+			return;
+		}
+		if (n <= 0)
+			break;
+		conn->http_sent += n;
 	}
-	return;
+	/* the request was read up to its end, closing won't reset */
+	del_service(conn);
 }
 
-
-static void obex_event(obex_t *handle, obex_object_t *obj, int mode, int event, int obex_cmd, int obex_rsp)
+/*
+ * Function metrics_reply()
+ *
+ *    Read the request up to the blank line after its headers, then
+ *    send the metrics and close. The request is not looked at, any
+ *    is answered with the metrics.
+ *
+ */
+static void metrics_reply(struct obexftpd_session *conn)
 {
-	char progress[] = "\\|/-";
-	static unsigned int i = 0;
-
-	switch (event) {
-	case OBEX_EV_STREAMAVAIL:
-       	printf("Time to read some data from stream\n");
-        break;
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+	struct rawdata_stream *body;
+	char buf[1024];
+	ssize_t n;
+	int i;
 
-	case OBEX_EV_LINKERR:
-        finished = 1;
-        obexftpd_reset = 1;
-        success = FALSE;
-		fprintf(stderr, "failed: %d\n", obex_cmd);
-		break;
+	if (conn->http_reply) {
+		metrics_send(conn);
+		return;
+	}
 
-    	case OBEX_EV_REQ:
-        printf("Incoming request %02x\n", obex_cmd);
-		/* Comes when a server-request has been received. */
-		server_request(handle, obj, event, obex_cmd);
-		break;
-		
-	case OBEX_EV_REQHINT:
-        /* An incoming request is about to come. Accept it! */
-		switch(obex_cmd) {
-		case OBEX_CMD_PUT:
-		case OBEX_CMD_CONNECT:
-		case OBEX_CMD_DISCONNECT:
-			OBEX_ObjectSetRsp(obj, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
+	for (;;) {
+		n = recv(conn->fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n < 0) {
+			del_service(conn);
+			return;
+		}
+		/* the client is done sending */
+		if (n == 0)
 			break;
-		default:
-			OBEX_ObjectSetRsp(obj, OBEX_RSP_NOT_IMPLEMENTED, OBEX_RSP_NOT_IMPLEMENTED);
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				if (conn->http_eol)
+					break;
+				conn->http_eol = 1;
+			} else if (buf[i] != '\r')
+				conn->http_eol = 0;
+		}
+		if (i < n)
 			break;
+		conn->http_read += n;
+		if (conn->http_read > METRICS_REQUEST_MAX) {
+			log_info("metrics request too long");
+			del_service(conn);
+			return;
 		}
-		break;
+	}
 
-	case OBEX_EV_REQCHECK:
-		/* e.g. mode=01, obex_cmd=03, obex_rsp=00 */
-            	printf("%s() OBEX_EV_REQCHECK: mode=%02x, obex_cmd=%02x, obex_rsp=%02x\n", __func__, 
-				mode, obex_cmd, obex_rsp);
-		OBEX_ObjectSetRsp(obj, OBEX_RSP_CONTINUE, OBEX_RSP_SUCCESS);
-		break;
-	case OBEX_EV_REQDONE:
-	        //finished = TRUE;
-        	if(obex_rsp == OBEX_RSP_SUCCESS)
-	        	success = TRUE;
-        	else {
-	            success = FALSE;
-        	    printf("%s() OBEX_EV_REQDONE: obex_rsp=%02x\n", __func__, obex_rsp);
-	        }
-		break;
+	body = metrics_render();
+	if (body)
+		conn->http_reply = INIT_RAWDATA_STREAM(sizeof(header) + body->size);
+	if (conn->http_reply == NULL ||
+	    ADD_RAWDATA_STREAM_DATA(conn->http_reply, header) < 0 ||
+	    ADD_RAWDATA_STREAM_BYTES(conn->http_reply, body->data, body->size) < 0) {
+		if (body)
+			FREE_RAWDATA_STREAM(body);
+		del_service(conn);
+		return;
+	}
+	FREE_RAWDATA_STREAM(body);
+	metrics_send(conn);
+}
 
-	case OBEX_EV_PROGRESS:
-		fprintf(stderr, "%c%c", 0x08, progress[i++]);
-		fflush(stdout);
-		if (i >= strlen(progress))
-			i = 0;
-			
-		switch(obex_cmd) {
-		case OBEX_CMD_PUT:
-			fprintf(stderr, "obex_ev_progress: obex_cmd_put\n");
-			put_done(handle, obj, 0);
-			break;
-		default:
-			break;
-		}
-		break;
-	case OBEX_EV_ABORT:
-		/* Request was aborted */
-            	printf("%s() OBEX_EV_ABORT: mode=%02x, obex_cmd=%02x, obex_rsp=%02x\n", __func__, 
-				mode, obex_cmd, obex_rsp);
-		break;
+static void metrics_accept(struct obexftpd_session *service)
+{
+	int fd;
 
-	case OBEX_EV_STREAMEMPTY:
-		//(void) cli_fillstream(cli, object);
-		break;
+	fd = accept(service->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (add_service(fd, metrics_reply) < 0)
+		close(fd);
+}
 
-	case OBEX_EV_UNEXPECTED:
-		/* Unexpected data, not fatal */
-		break;
-    default:
-         printf("%s() Unhandled event %d\n", __func__, event);
-         break;
+/*
+ * Function metrics_init()
+ *
+ *    Listen on metrics_addr, a path for a Unix socket or a port
+ *    on 127.0.0.1. Workers take the path with their number
+ *    appended, or the port plus their number.
+ *
+ */
+static int metrics_init(void)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	int fd, len, one = 1;
 
+	if (metrics_addr == NULL)
+		return 0;
+
+	if (metrics_addr[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (worker_index >= 0)
+			len = snprintf(sun.sun_path, sizeof(sun.sun_path), "%s.%d", metrics_addr, worker_index);
+		else
+			len = snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", metrics_addr);
+		if (len >= (int) sizeof(sun.sun_path) || len >= (int) sizeof(metrics_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		(void) unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			goto err;
+		strcpy(metrics_path, sun.sun_path);
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(atoi(metrics_addr) + (worker_index >= 0 ? worker_index : 0));
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+			goto err;
+	}
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (listen(fd, 8) < 0 || add_service(fd, metrics_accept) < 0)
+		goto err;
+	metrics_fd = fd;
+	return 0;
+
+err:
+	close(fd);
+	if (metrics_path[0]) {
+		(void) unlink(metrics_path);
+		metrics_path[0] = '\0';
+	}
+	return -1;
+}
+
+/* after free_services() */
+static void metrics_stop(void)
+{
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+	if (metrics_path[0]) {
+		(void) unlink(metrics_path);
+		metrics_path[0] = '\0';
 	}
 }
+//END of the metrics endpoint
 
 
-static void start_server(int transport)
+static obex_t *start_listener(int transport)
 {
-	int use_sdp = 0;
 	obex_t *handle = NULL;
 	struct sockaddr_in saddr;
 
-	if (NULL == getcwd(init_work_path, WORK_PATH_MAX) && ERANGE == errno)
-	{
-		fprintf(stderr, "Wah, work path is too long, exceed %d.\n", WORK_PATH_MAX);
-		exit(0);
-	}
-
-       	if (transport==OBEX_TRANS_BLUETOOTH && 0 > obexftp_sdp_register_ftp(channel))
-       	{
-       		//OBEX_Cleanup(handle);
-       		fprintf(stderr, "register to SDP Server failed.\n");
-       	}
-       	else
-       	{
-       		use_sdp = 1;
-       	}
-	
-reset:
 	handle = OBEX_Init(transport, obex_event, 0);
 	if (NULL == handle) {
-       		perror("failed to init obex.");
+       		log_errno(LVL_ERROR, "failed to init obex.");
        		exit(-1);
 	}
+	set_response_mode(handle);
 
 	switch (transport) {
        	case OBEX_TRANS_INET:
@@ -874,65 +4299,434 @@ reset:
                 (void) inet_aton(device, &saddr.sin_addr);
 #endif
 		if (0 > TcpOBEX_ServerRegister(handle, (struct sockaddr *)&saddr, sizeof(saddr))) {
-       			perror("failed to register inet server");
+       			log_errno(LVL_ERROR, "failed to register inet server");
 	       		exit(-1);
 		}
 	       	break;
 #ifdef HAVE_BLUETOOTH
        	case OBEX_TRANS_BLUETOOTH:
 		if (0 > BtOBEX_ServerRegister(handle, /*bdaddr_t *bt_src*/NULL, channel)) {
-       			perror("failed to register bluetooth server");
+       			log_errno(LVL_ERROR, "failed to register bluetooth server");
 	       		exit(-1);
 		}
        		break;
 #endif
        	case OBEX_TRANS_IRDA:
 		if (0 > IrOBEX_ServerRegister(handle, "")) {
-       			perror("failed to register IrDA server");
+       			log_errno(LVL_ERROR, "failed to register IrDA server");
 	       		exit(-1);
 		}
 	       	break;
        	case OBEX_TRANS_CUSTOM:
 		/* A simple Ericsson protocol session perhaps? */
        	default:
-       		fprintf(stderr, "Transport type unknown\n");
+       		log_error("Transport type unknown");
 	       		exit(-1);
 	}
-	printf("Waiting for connection...\n");
 
-	(void) OBEX_ServerAccept(handle, obex_event, NULL);
+	return handle;
+}
+
+//BEGIN of listener policy
+/*
+ * The listener stays up across sessions. A link it fails to hand over
+ * is dropped, not the listener. New connections can be limited to
+ * accept_rate a second, and a failing listener backs off; either way
+ * it just isn't watched for a while. Only a listener failing over and
+ * over is set up anew.
+ */
+static struct token_bucket accept_bucket;
+static struct obexftpd_session *accept_service = NULL; /* of a worker */
+static long long listen_resume = 0;	/* ms, while paused */
+static int accept_paused = 0;
+static int listen_backoff = 0;
+static int listen_errors = 0;
+
+static void listener_watch(int watch)
+{
+	if (accept_service)
+		loop_pause(accept_service->fd, accept_service, !watch);
+	else if (listen_fd >= 0)
+		loop_pause(listen_fd, NULL, !watch);
+	accept_paused = !watch;
+}
+
+static void listener_pause(long ms)
+{
+	if (!accept_paused)
+		listener_watch(0);
+	listen_resume = now_ms() + ms;
+}
+
+/* watch it again once the pause is over */
+static void listener_check(void)
+{
+	if (accept_paused && now_ms() >= listen_resume) {
+		listener_watch(1);
+		listen_resume = 0;
+	}
+}
+
+/* how long the event loop may wait, at most timeout ms */
+static int listener_timeout(int timeout)
+{
+	long long wait;
+
+	if (!accept_paused)
+		return timeout;
+	wait = listen_resume - now_ms();
+	if (wait < 0)
+		wait = 0;
+	return wait < timeout ? (int) wait : timeout;
+}
+
+static void listener_accepted(void)
+{
+	listen_errors = 0;
+	listen_backoff = 0;
+	if (accept_bucket.rate == 0)
+		return;
+	bucket_refill(&accept_bucket, now_ms());
+	accept_bucket.tokens--;
+	if (accept_bucket.tokens < 1)
+		listener_pause((1 - accept_bucket.tokens) * 1000 / accept_bucket.rate + 1);
+}
+
+static void listener_failed(int transport)
+{
+	if (++listen_errors >= LISTEN_MAX_ERRORS) {
+		log_warn("listener keeps failing, setting it up anew");
+		loop_del(listen_fd);
+		OBEX_Cleanup(listener);
+		listen_paused = accept_paused = 0;
+		listener = start_listener(transport);
+		listen_fd = OBEX_GetFD(listener);
+		if (loop_add(listen_fd, NULL) < 0) {
+			log_errno(LVL_ERROR, "failed to watch listener");
+			exit(-1);
+		}
+		listen_errors = 0;
+	}
+	listen_backoff = listen_backoff ? 2 * listen_backoff : LISTEN_BACKOFF_MIN;
+	if (listen_backoff > LISTEN_BACKOFF_MAX)
+		listen_backoff = LISTEN_BACKOFF_MAX;
+	log_warn("listener failed, pausing it for %d ms", listen_backoff);
+	listener_pause(listen_backoff);
+}
+//END of listener policy
+
+//BEGIN of worker processes
+/*
+ * With --workers each process binds the TCP port itself with
+ * SO_REUSEPORT, so the kernel spreads connections over their event
+ * loops and nothing is shared between them. OpenOBEX binds its server
+ * sockets without that option, so workers accept connections
+ * themselves and hand them to an OBEX_TRANS_FD handle.
+ */
+static pid_t *worker_pids = NULL;
+
+static void start_server(int transport);
+
+static void worker_accept(struct obexftpd_session *service)
+{
+	int i, fd;
+
+	/* a few per wakeup, the loop comes back for the rest */
+	for (i = 0; i < MAX_EVENTS && !accept_paused; i++) {
+		fd = accept(service->fd, NULL, NULL);
+		if (fd < 0)
+			break;
+		(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+		accept_fd_session(fd);
+		listener_accepted();
+	}
+}
+
+static int worker_listen(void)
+{
+#ifdef SO_REUSEPORT
+	struct sockaddr_in saddr;
+	int fd, one = 1;
+
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(channel);
+	(void) inet_aton(device, &saddr.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+	    bind(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0)
+		goto err;
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (add_service(fd, worker_accept) < 0)
+		goto err;
+	accept_service = services;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void stop_signal(int UNUSED(sig))
+{
+	finished = 1;
+}
+
+/* SIGTERM and SIGINT end the loop, which commits what is queued */
+static void catch_stop_signals(void)
+{
+	struct sigaction sa;
+
+	/* no SA_RESTART, wait() and the event loop have to return */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+}
+
+static pid_t start_worker(int transport, int index)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+#ifdef HAVE_SYS_PRCTL_H
+	/* don't outlive the parent, stopping like on SIGTERM */
+	(void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	free(worker_pids);
+	worker_index = index;
+	start_server(transport);
+	exit(0);
+}
+
+/*
+ * Function run_workers()
+ *
+ *    Fork the workers and restart any that crashes, until told to
+ *    stop. A worker that exits on its own, e.g. as it couldn't bind
+ *    the port, ends them all.
+ *
+ */
+static void run_workers(int transport)
+{
+	pid_t pid;
+	int i, status;
+
+	if (workers <= 1 || transport != OBEX_TRANS_INET) {
+		start_server(transport);
+		return;
+	}
+#ifndef SO_REUSEPORT
+	log_warn("no SO_REUSEPORT, running a single process");
+	start_server(transport);
+#else
+	worker_pids = calloc(workers, sizeof(*worker_pids));
+	if (worker_pids == NULL) {
+		log_error("out of memory");
+		exit(-1);
+	}
+
+	catch_stop_signals();
+
+	for (i = 0; i < workers && !finished; i++) {
+		worker_pids[i] = start_worker(transport, i);
+		if (worker_pids[i] < 0) {
+			log_errno(LVL_ERROR, "fork failed");
+			finished = 1;
+		}
+	}
+	log_info("Started %d workers", workers);
 
 	while (!finished) {
-		//printf("Handling connection...\n");
-		OBEX_HandleInput(handle, 1);
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < workers && worker_pids[i] != pid; i++)
+			;
+		if (i == workers)
+			continue;
+		worker_pids[i] = 0;
+		if (!WIFSIGNALED(status)) {
+			log_error("worker %d exited, stopping", i);
+			finished = 1;
+			break;
+		}
+		log_error("worker %d died of signal %d, restarting", i, WTERMSIG(status));
+		worker_pids[i] = start_worker(transport, i);
+		if (worker_pids[i] < 0) {
+			log_errno(LVL_ERROR, "fork failed");
+			break;
+		}
 	}
 
-	OBEX_Cleanup(handle);
-	sleep(1); /* throttle */
+	for (i = 0; i < workers; i++)
+		if (worker_pids[i] > 0)
+			kill(worker_pids[i], SIGTERM);
+	for (i = 0; i < workers; i++)
+		if (worker_pids[i] > 0)
+			(void) waitpid(worker_pids[i], NULL, 0);
+	free(worker_pids);
+	worker_pids = NULL;
+#endif
+}
+//END of worker processes
+
+static void start_server(int transport)
+{
+	int use_sdp = 0;
+	struct obexftpd_session *ready[MAX_EVENTS];
+	int i, n;
 
-	if (obexftpd_reset)
+	/* the served tree, set with --chdir */
+	root_fd = open(".", O_RDONLY | O_DIRECTORY);
+	if (root_fd < 0)
 	{
-		fprintf(stderr, "obexftpd reset\n");
-		obexftpd_reset = 0;
-		finished = 0;
-		success = 0;
-		goto reset;
+		log_errno(LVL_ERROR, "failed to open work path");
+		exit(-1);
+	}
+	if (blob_fd >= 0) {
+		struct stat root_st, blob_st;
+
+		/* hard links don't cross file systems */
+		if (fstat(root_fd, &root_st) < 0 || fstat(blob_fd, &blob_st) < 0 ||
+		    root_st.st_dev != blob_st.st_dev) {
+			log_warn("dedup store isn't on the served file system, not deduplicating");
+			close(blob_fd);
+			blob_fd = -1;
+		} else if (worker_index <= 0)
+			blob_sweep();
+	}
+
+       	if (transport==OBEX_TRANS_BLUETOOTH && 0 > obexftp_sdp_register_ftp(channel))
+       	{
+       		//OBEX_Cleanup(handle);
+       		log_error("register to SDP Server failed.");
+       	}
+       	else
+       	{
+       		use_sdp = 1;
+       	}
+
+	/* links other than TCP are too slow for the copy to matter */
+	if (transport != OBEX_TRANS_INET)
+		use_mmap = 0;
+	if (use_mmap)
+		map_init();
+
+#ifndef _WIN32
+	/* a client hanging up mid-transfer must not take the server down */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, log_level_signal);
+	signal(SIGUSR2, log_level_signal);
+	/* in workers too, what they queued is committed on the way out */
+	catch_stop_signals();
+#endif
+	log_start();
+	bucket_init(&total_bucket, total_rate);
+	bucket_init(&accept_bucket, accept_rate);
+	/* burst a second worth */
+	accept_bucket.burst = accept_bucket.tokens = accept_rate > 0 ? accept_rate : 1;
+	if (loop_init() < 0) {
+		log_errno(LVL_ERROR, "failed to init event loop");
+		exit(-1);
+	}
+	if (listing_cache_init() >= 0 && add_service(inotify_fd, listing_cache_notify) < 0) {
+		log_errno(LVL_ERROR, "failed to watch inotify");
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (metrics_init() < 0)
+		log_errno(LVL_WARN, "failed to start the metrics endpoint");
+	if (worker_index >= 0 && worker_listen() < 0) {
+		log_errno(LVL_ERROR, "failed to listen");
+		exit(-1);
+	}
+	if (io_init(io_threads) < 0)
+		log_errno(LVL_WARN, "failed to start I/O workers, doing I/O inline");
+	else if (io_notify_fd[0] >= 0 && add_service(io_notify_fd[0], io_notify) < 0) {
+		log_errno(LVL_WARN, "failed to watch I/O workers, doing I/O inline");
+		io_stop();
+	}
+	
+	/* workers listen themselves */
+	if (worker_index < 0) {
+		listener = start_listener(transport);
+		listen_fd = OBEX_GetFD(listener);
+		if (loop_add(listen_fd, NULL) < 0) {
+			log_errno(LVL_ERROR, "failed to watch listener");
+			exit(-1);
+		}
+	}
+	log_info("Waiting for connections...");
+
+	while (!finished) {
+		n = loop_wait(ready, sync_timeout(listener_timeout(sched_timeout(1000))));
+		if (n < 0 && errno != EINTR) {
+			log_errno(LVL_ERROR, "event loop failed");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ready[i] == NULL) {
+				if (OBEX_HandleInput(listener, 0) < 0)
+					listener_failed(transport);
+			} else if (ready[i]->input) {
+				ready[i]->input(ready[i]);
+			} else if (!ready[i]->finished) {
+				sched_add(ready[i]);
+			}
+		}
+		listener_check();
+		sync_check();
+		sched_run();
+		reap_sessions(0);
+	}
+
+	if (listener) {
+		loop_del(listen_fd);
+		listen_fd = -1;
+		OBEX_Cleanup(listener);
+		listener = NULL;
 	}
+
+	/* before the sessions go, so those waiting hear how it went */
+	sync_stop();
+	reap_sessions(1);
+	free_services();
+	metrics_stop();
+	io_stop();
 	
 	if (use_sdp)
 	{
-		fprintf(stderr, "sdp unregister\n");
+		log_debug("sdp unregister");
 		if (0 > obexftp_sdp_unregister_ftp())
 		{
-       			fprintf(stderr, "unregister from SDP Server failed.\n");
+       			log_error("unregister from SDP Server failed.");
 		}
 	}
-
+	log_stop();
 }
 
 int main(int argc, char *argv[])
 {
-	int c;
+	int c, i;
 	
 	while (1) {
 		int option_index = 0;
@@ -942,6 +4736,18 @@ int main(int argc, char *argv[])
 			{"tty",		required_argument, NULL, 't'},
 			{"network",	required_argument, NULL, 'n'},
 			{"chdir",	required_argument, NULL, 'c'},
+			{"nosrm",	no_argument, NULL, 'R'},
+			{"nommap",	no_argument, NULL, 'M'},
+			{"io-threads",	required_argument, NULL, 'I'},
+			{"sync",	required_argument, NULL, 'S'},
+			{"dedup",	required_argument, NULL, 'D'},
+			{"rate",	required_argument, NULL, 'r'},
+			{"total-rate",	required_argument, NULL, 'T'},
+			{"quantum",	required_argument, NULL, 'Q'},
+			{"workers",	required_argument, NULL, 'w'},
+			{"accept-rate",	required_argument, NULL, 'A'},
+			{"metrics",	required_argument, NULL, 'm'},
+			{"log-level",	required_argument, NULL, 'L'},
 			{"verbose",	no_argument, NULL, 'v'},
 			{"version",	no_argument, NULL, 'V'},
 			{"help",	no_argument, NULL, 'h'},
@@ -949,7 +4755,7 @@ int main(int argc, char *argv[])
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long (argc, argv, "-ib::t:n:c:vVh",
+		c = getopt_long (argc, argv, "-ib::t:n:c:RMI:S:D:r:T:Q:w:A:m:L:vVh",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -965,14 +4771,14 @@ int main(int argc, char *argv[])
 				channel = atoi(optarg);
 			}
 			start_server(OBEX_TRANS_BLUETOOTH);
-			fprintf(stderr, "server end\n");
+			log_info("server end");
 			break;
 
 		case 'n':
 			parsehostport(optarg, &device, &channel);
 			//channel = atoi(optarg);
-			start_server(OBEX_TRANS_INET);
-			fprintf(stderr, "server end\n");
+			run_workers(OBEX_TRANS_INET);
+			log_info("server end");
 			break;
 
 		case 't':
@@ -984,8 +4790,85 @@ int main(int argc, char *argv[])
 			chdir(optarg);
 			break;
 
+		case 'R':
+			use_srm = 0;
+			break;
+
+		case 'M':
+			use_mmap = 0;
+			break;
+
+		case 'I':
+			io_threads = atoi(optarg);
+			break;
+
+		case 'r':
+			session_rate = atol(optarg) * 1024;
+			break;
+
+		case 'T':
+			total_rate = atol(optarg) * 1024;
+			break;
+
+		case 'Q':
+			sched_quantum = atol(optarg);
+			if (sched_quantum < 1)
+				sched_quantum = SCHED_QUANTUM;
+			break;
+
+		case 'w':
+			workers = atoi(optarg);
+			break;
+
+		case 'A':
+			accept_rate = atol(optarg);
+			break;
+
+		case 'D':
+			if (blob_fd >= 0)
+				close(blob_fd);
+			if (blob_open(optarg) < 0) {
+				perror(optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'S':
+			if (!strcmp(optarg, "none"))
+				sync_mode = SYNC_NONE;
+			else if (!strcmp(optarg, "file"))
+				sync_mode = SYNC_FILE;
+			else if (!strncmp(optarg, "group", 5) &&
+				 (optarg[5] == '\0' || optarg[5] == ':')) {
+				sync_mode = SYNC_GROUP;
+				if (optarg[5] == ':')
+					sync_interval = atoi(optarg + 6);
+				if (sync_interval < 0)
+					sync_interval = 0;
+			} else {
+				fprintf(stderr, "unknown sync mode %s\n", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'm':
+			metrics_addr = optarg;
+			break;
+
+		case 'L':
+			for (i = 0; i <= LVL_DEBUG; i++)
+				if (!strcmp(optarg, log_levels[i]))
+					break;
+			if (i > LVL_DEBUG) {
+				fprintf(stderr, "unknown log level %s\n", optarg);
+				exit(-1);
+			}
+			log_level = i;
+			break;
+
 		case 'v':
-			verbose++;
+			if (log_level < LVL_DEBUG)
+				log_level++;
 			break;
 
 		case 'V':
@@ -994,7 +4877,7 @@ int main(int argc, char *argv[])
 
 		case 'h':
 			printf("ObexFTPd %s\n", VERSION);
-			printf("Usage: %s  [-c <path>]  [-v]  [-i | -b | -t <dev> | -n <port>]\n"
+			printf("Usage: %s  [-c <path>]  [-R]  [-M]  [-I <n>]  [-S <mode>]  [-D <path>]  [-r <kB/s>]  [-T <kB/s>]  [-Q <bytes>]  [-w <n>]  [-A <n>]  [-m <socket>]  [-L <level>]  [-v]  [-i | -b | -t <dev> | -n <port>]\n"
 				"Recieve files from/to Mobile Equipment.\n"
 				"Copyright (c) 2003-2006 Christian W. Zuckschwerdt, Alan Zhang,\n"
 				"                        Hendrik Sattler, Frode Isaksen\n"
@@ -1005,7 +4888,19 @@ int main(int argc, char *argv[])
 				" -n, --network <port>        accept network connections\n"
 				"\n"
 				" -c, --chdir <path>          set a default basedir\n"
-				" -v, --verbose               verbose messages\n"
+				" -R, --nosrm                 refuse single response mode\n"
+				" -M, --nommap                read served files instead of mapping them\n"
+				" -I, --io-threads <n>        file I/O threads, 0 for none (default 2)\n"
+				" -S, --sync <mode>           none (default), file or group[:<ms>]\n"
+				" -D, --dedup <path>          keep uploads once per content in this store\n"
+				" -r, --rate <kB/s>           limit the rate of each connection\n"
+				" -T, --total-rate <kB/s>     limit the rate of all connections\n"
+				" -Q, --quantum <bytes>       bytes a connection may send per turn\n"
+				" -w, --workers <n>           share a network port among n processes\n"
+				" -A, --accept-rate <n>       accept at most n connections a second\n"
+				" -m, --metrics <path|port>   serve metrics on a Unix socket or local port\n"
+				" -L, --log-level <level>     error, warning (default), info or debug\n"
+				" -v, --verbose               one log level more\n"
 				"\n"
 				" -V, --version               print version info\n"
 				" -h, --help, --usage         this help text\n",
@@ -0,0 +1,188 @@
+/**
+	\file apps/obexftpd_bench.c
+	Compare the CPU cost of obexftpd serving files mapped vs. read.
+	ObexFTP library - language bindings for OBEX file transfer.
+
+	Copyright (c) 2003-2006 Christian W. Zuckschwerdt <zany@triq.net>
+
+	ObexFTP is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as
+	published by the Free Software Foundation; either version 2 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public
+	License along with ObexFTP. If not, see <http://www.gnu.org/>.
+ */
+
+/*
+ * Starts obexftpd on the loopback interface, fetches the same file a
+ * number of times over TCP and reports the CPU time the server used,
+ * taken from wait4(), per GB served. Run once with the mapped and once
+ * with the read path (--nommap).
+ *
+ * usage: obexftpd_bench <obexftpd> <dir> <file> [<count> [<port>]]
+ *
+ * The file is looked up in dir. OBEX over TCP uses port 650 by default,
+ * which needs root; pass a port above 1023 to run as a normal user
+ * (with an OpenOBEX whose TCP connect honours the port).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include <obexftp/obexftp.h>
+#include <obexftp/client.h>
+
+#define HOST	"127.0.0.1"
+
+static pid_t start_daemon(const char *daemon, const char *dir, int port, int use_mmap)
+{
+	char hostport[32];
+	pid_t pid;
+	int fd;
+
+	snprintf(hostport, sizeof(hostport), "%s:%d", HOST, port);
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	/* obexftpd is chatty */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+	}
+	if (use_mmap)
+		execl(daemon, daemon, "-c", dir, "-n", hostport, NULL);
+	else
+		execl(daemon, daemon, "-c", dir, "-M", "-n", hostport, NULL);
+	_exit(127);
+}
+
+static int run(const char *daemon, const char *dir, const char *file, int count, int port,
+	       int use_mmap)
+{
+	obexftp_client_t *cli;
+	struct rusage ru;
+	struct timeval start, end;
+	struct stat st;
+	char *path;
+	double cpu, wall, gb;
+	pid_t pid;
+	int status;
+	int i, retry;
+
+	path = malloc(strlen(dir) + strlen(file) + 2);
+	if (path == NULL)
+		return -1;
+	sprintf(path, "%s/%s", dir, file);
+	if (stat(path, &st) < 0) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	pid = start_daemon(daemon, dir, port, use_mmap);
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	cli = obexftp_open(OBEX_TRANS_INET, NULL, NULL, NULL);
+	if (cli == NULL) {
+		fprintf(stderr, "Error opening obexftp client\n");
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	/* give the daemon some time to come up */
+	for (retry = 0; retry < 20; retry++) {
+		if (obexftp_connect(cli, HOST, port) >= 0)
+			break;
+		usleep(100000);
+	}
+	if (retry == 20) {
+		fprintf(stderr, "Can't connect to %s\n", daemon);
+		obexftp_close(cli);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		if (obexftp_get(cli, "/dev/null", file) < 0) {
+			fprintf(stderr, "GET %s failed\n", file);
+			break;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	(void) obexftp_disconnect(cli);
+	obexftp_close(cli);
+
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return -1;
+	}
+
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	wall = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	gb = (double) st.st_size * i / (1 << 30);
+	if (gb <= 0) {
+		fprintf(stderr, "nothing transferred\n");
+		return -1;
+	}
+
+	printf("%-6s %d x %ld bytes: server cpu %.3f s (user %ld.%03ld, sys %ld.%03ld), "
+		"%.3f cpu s/GB, %.1f MB/s\n",
+		use_mmap ? "mmap" : "read", i, (long) st.st_size, cpu,
+		(long) ru.ru_utime.tv_sec, (long) ru.ru_utime.tv_usec / 1000,
+		(long) ru.ru_stime.tv_sec, (long) ru.ru_stime.tv_usec / 1000,
+		cpu / gb, st.st_size * i / wall / (1 << 20));
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = 10;
+	int port = 650;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <obexftpd> <dir> <file> [<count> [<port>]]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 4)
+		count = atoi(argv[4]);
+	if (argc > 5)
+		port = atoi(argv[5]);
+
+	if (run(argv[1], argv[2], argv[3], count, port, 0) < 0)
+		exit(1);
+	if (run(argv[1], argv[2], argv[3], count, port, 1) < 0)
+		exit(1);
+
+	exit(0);
+}
@@ -0,0 +1,226 @@
+/**
+	\file apps/obexftpd_test.c
+	Fetch files from obexftpd over loopback with and without SRM.
+	ObexFTP library - language bindings for OBEX file transfer.
+
+	Copyright (c) 2003-2006 Christian W. Zuckschwerdt <zany@triq.net>
+
+	ObexFTP is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as
+	published by the Free Software Foundation; either version 2 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public
+	License along with ObexFTP. If not, see <http://www.gnu.org/>.
+ */
+
+/*
+ * Starts obexftpd on the loopback interface in a scratch directory,
+ * once answering single response mode (SRM) requests and once with
+ * --nosrm, and GETs files of a few sizes with the client asking for
+ * SRM and not. Every body must arrive complete and unchanged. A GET
+ * that stalls makes the test fail after a timeout.
+ *
+ * usage: obexftpd_test <obexftpd> [<port>]
+ *
+ * OBEX over TCP uses port 650 by default, which needs root.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include <obexftp/obexftp.h>
+#include <obexftp/client.h>
+
+#define HOST	"127.0.0.1"
+/* seconds a GET may take */
+#define TIMEOUT	30
+
+/* an empty file, one packet, and many with an odd tail */
+static const int sizes[] = { 0, 1000, 3 * 1024 * 1024 + 123 };
+
+static pid_t daemon_pid = 0;
+
+static void timeout(int sig)
+{
+	(void) sig;
+	fprintf(stderr, "GET stalled\n");
+	if (daemon_pid > 0)
+		kill(daemon_pid, SIGTERM);
+	_exit(1);
+}
+
+static pid_t start_daemon(const char *daemon, const char *dir, int port, int use_srm)
+{
+	char hostport[32];
+	pid_t pid;
+	int fd;
+
+	snprintf(hostport, sizeof(hostport), "%s:%d", HOST, port);
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	/* obexftpd is chatty */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+	}
+	if (use_srm)
+		execl(daemon, daemon, "-c", dir, "-n", hostport, NULL);
+	else
+		execl(daemon, daemon, "-c", dir, "-R", "-n", hostport, NULL);
+	_exit(127);
+}
+
+static uint8_t *make_file(const char *dir, int i, int size)
+{
+	char path[512];
+	uint8_t *data;
+	int fd, n;
+
+	data = malloc(size + 1);
+	if (data == NULL)
+		return NULL;
+	for (n = 0; n < size; n++)
+		data[n] = (n * 7 + i) ^ (n >> 8);
+
+	snprintf(path, sizeof(path), "%s/file%d", dir, i);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, data, size) != size) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		free(data);
+		return NULL;
+	}
+	close(fd);
+	return data;
+}
+
+static int run(const char *daemon, const char *dir, int port, int server_srm,
+	       uint8_t **data)
+{
+	obexftp_client_t *cli;
+	char name[32];
+	int client_srm, i, retry;
+	int failed = 0;
+
+	daemon_pid = start_daemon(daemon, dir, port, server_srm);
+	if (daemon_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	for (client_srm = 0; client_srm < 2; client_srm++) {
+		cli = obexftp_open(OBEX_TRANS_INET, NULL, NULL, NULL);
+		if (cli == NULL) {
+			fprintf(stderr, "Error opening obexftp client\n");
+			failed++;
+			break;
+		}
+		if (!client_srm)
+			cli->quirks &= ~OBEXFTP_SRM;
+
+		/* give the daemon some time to come up */
+		for (retry = 0; retry < 20; retry++) {
+			if (obexftp_connect(cli, HOST, port) >= 0)
+				break;
+			usleep(100000);
+		}
+		if (retry == 20) {
+			fprintf(stderr, "Can't connect to %s\n", daemon);
+			obexftp_close(cli);
+			failed++;
+			break;
+		}
+
+		for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+			snprintf(name, sizeof(name), "file%d", i);
+			alarm(TIMEOUT);
+			if (obexftp_get(cli, NULL, name) < 0) {
+				fprintf(stderr, "GET %s failed\n", name);
+				failed++;
+			} else if ((int) cli->buf_size != sizes[i] ||
+				   (sizes[i] > 0 && memcmp(cli->buf_data, data[i], sizes[i]))) {
+				fprintf(stderr, "GET %s: got %u bytes of %d, or they differ\n",
+					name, cli->buf_size, sizes[i]);
+				failed++;
+			}
+			alarm(0);
+			free(cli->buf_data);
+			cli->buf_data = NULL;
+			cli->buf_size = 0;
+		}
+		printf("server %s SRM, client %s: %s\n", server_srm ? "with" : "without",
+			client_srm ? "asking for it" : "not asking", failed ? "FAILED" : "ok");
+
+		(void) obexftp_disconnect(cli);
+		obexftp_close(cli);
+	}
+
+	kill(daemon_pid, SIGTERM);
+	waitpid(daemon_pid, NULL, 0);
+	daemon_pid = 0;
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/obexftpd_test.XXXXXX";
+	char path[512];
+	uint8_t *data[sizeof(sizes) / sizeof(sizes[0])];
+	int port = 650;
+	int failed = 0;
+	int i, n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <obexftpd> [<port>]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		port = atoi(argv[2]);
+
+	signal(SIGALRM, timeout);
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	n = sizeof(sizes) / sizeof(sizes[0]);
+	for (i = 0; i < n; i++) {
+		data[i] = make_file(dir, i, sizes[i]);
+		if (data[i] == NULL)
+			exit(1);
+	}
+
+	if (run(argv[1], dir, port, 1, data) < 0)
+		failed++;
+	if (run(argv[1], dir, port, 0, data) < 0)
+		failed++;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		unlink(path);
+		free(data[i]);
+	}
+	rmdir(dir);
+
+	exit(failed ? 1 : 0);
+}
@@ -43,6 +43,7 @@
 
 #include "crc.h"
 #include "bfb.h"
+#include "bfb_io.h"
 #include <common.h>
 
 /* Provide convenience macros for handling structure
@@ -294,34 +295,25 @@ int bfb_write_subcmd_lw(fd_t fd, uint8_t type, uint8_t subtype, uint32_t p1, uin
 }
 
 
+#define BFB_WRITEV_FRAMES 256 /* frames coalesced into one writev() */
+
 /**
 	Send actual packets.
 	Patch from Jorge Ventura to handle EAGAIN from write.
+
+	Frame headers and payloads go out together with writev(), a batch
+	of frames at a time, waiting for the port to drain on EAGAIN.
  */
 int bfb_write_packets(fd_t fd, uint8_t type, uint8_t *buffer, int length)
 {
-	bfb_frame_t *frame;
 	int i;
 	int l;
-
-	struct timeval timeout;
-	fd_set fds;
-	int rc;
 #ifdef _WIN32
+	bfb_frame_t *frame;
 	DWORD actual;
-#else
-	int actual;
-#endif
 
-#ifdef _WIN32
         return_val_if_fail (fd != INVALID_HANDLE_VALUE, FALSE);
-#else
-        return_val_if_fail (fd > 0, FALSE);
-#endif
-	/* select setup */
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	
+
 	/* alloc frame buffer */
 	frame = malloc((length > MAX_PACKET_DATA ? MAX_PACKET_DATA : length) + sizeof (bfb_frame_t));
 	if (frame == NULL)
@@ -339,36 +331,55 @@ int bfb_write_packets(fd_t fd, uint8_t type, uint8_t *buffer, int length)
 
 		memcpy(frame->payload, &buffer[i], l);
 
-		/* Set time limit. */
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-
-		/* actual = bfb_io_write(fd, frame, l + sizeof (bfb_frame_t)); */
-		rc = select(fd+1, NULL, &fds, NULL, &timeout);
-		if ( rc > 0) {
-#ifdef _WIN32
-			if(!WriteFile(fd, frame, l + sizeof (bfb_frame_t), &actual, NULL))
-				DEBUG(2, "%s() Write error: %ld\n", __func__, actual);
-			DEBUG(3, "%s() Wrote %ld bytes (expected %d)\n", __func__, actual, l + sizeof (bfb_frame_t));
-#else
-			actual = write(fd, frame, l + sizeof (bfb_frame_t));
-			DEBUG(3, "%s() Wrote %d bytes (expected %d)\n", __func__, actual, l + sizeof (bfb_frame_t));
-			// delay for some USB-serial coverters (Gerhard Reithofer)
-			// usleep(1000); // there has to be a better way
-#endif
-			if (actual < 0 || actual < l + (int) sizeof (bfb_frame_t)) {
-				DEBUG(1, "%s() Write failed\n", __func__);
-				free(frame);
-				return -1;
-			}
-		} else { /* ! rc > 0*/
-			DEBUG(1, "%s() Select failed\n", __func__);
+		if(!WriteFile(fd, frame, l + sizeof (bfb_frame_t), &actual, NULL))
+			DEBUG(2, "%s() Write error: %ld\n", __func__, actual);
+		DEBUG(3, "%s() Wrote %ld bytes (expected %d)\n", __func__, actual, l + sizeof (bfb_frame_t));
+		if (actual < l + sizeof (bfb_frame_t)) {
+			DEBUG(1, "%s() Write failed\n", __func__);
 			free(frame);
 			return -1;
 		}
-
 	}
 	free(frame);
+#else
+	bfb_frame_t header[BFB_WRITEV_FRAMES];
+	struct iovec iov[2 * BFB_WRITEV_FRAMES];
+	int frames;
+	int expected;
+	int actual;
+
+        return_val_if_fail (fd > 0, FALSE);
+
+	for(i=0; i <length; ) {
+
+		frames = 0;
+		expected = 0;
+		for(; i < length && frames < BFB_WRITEV_FRAMES; i += MAX_PACKET_DATA) {
+
+			l = length - i;
+			if (l > MAX_PACKET_DATA)
+				l = MAX_PACKET_DATA;
+
+			header[frames].type = type;
+			header[frames].len = l;
+			header[frames].chk = header[frames].type ^ header[frames].len;
+
+			iov[2 * frames].iov_base = &header[frames];
+			iov[2 * frames].iov_len = sizeof (bfb_frame_t);
+			iov[2 * frames + 1].iov_base = &buffer[i];
+			iov[2 * frames + 1].iov_len = l;
+			expected += l + sizeof (bfb_frame_t);
+			frames++;
+		}
+
+		actual = bfb_io_writev(fd, iov, 2 * frames, BFB_IO_WRITE_TIMEOUT);
+		DEBUG(3, "%s() Wrote %d bytes in %d frames (expected %d)\n", __func__, actual, frames, expected);
+		if (actual < expected) {
+			DEBUG(1, "%s() Write failed\n", __func__);
+			return -1;
+		}
+	}
+#endif
 	return i / MAX_PACKET_DATA;
 }
 
@@ -397,8 +408,47 @@ int bfb_send_data(fd_t fd, uint8_t type, uint8_t *data, uint16_t length, uint8_t
 }
 
 
+/**
+	Find the first frame in a buffer, in place.
+
+	\param buffer received data
+	\param length bytes in buffer
+	\param used set to the size of the frame found
+	\return the frame within buffer, NULL if there is no complete one
+ */
+/*@null@*/
+bfb_frame_t *bfb_parse_frame(uint8_t *buffer, int length, int *used)
+{
+	bfb_frame_t *frame;
+
+	*used = 0;
+	if (length < (int) sizeof(bfb_frame_t)) {
+		DEBUG(3, "%s() Short packet?\n", __func__);
+		return NULL;
+	}
+
+	frame = (bfb_frame_t *)buffer;
+	if ((frame->type ^ frame->len) != frame->chk) {
+		DEBUG(1, "%s() Header error?\n", __func__);
+		DEBUGBUFFER(buffer, length);
+		return NULL;
+	}
+
+	if (length < frame->len + (int) sizeof(bfb_frame_t)) {
+		DEBUG(2, "%s() Need more data?\n", __func__);
+		return NULL;
+	}
+
+	*used = sizeof(bfb_frame_t) + frame->len;
+	DEBUG(3, "%s() Packet 0x%02x (%d bytes)\n", __func__, frame->type, frame->len);
+	return frame;
+}
+
+
 /**
 	Retrieve actual packets.
+
+	\note the frame is a copy to be freed, bfb_parse_frame() avoids that
  */
 /*@null@*/
 bfb_frame_t *bfb_read_packets(uint8_t *buffer, int *length)
@@ -418,28 +468,10 @@ bfb_frame_t *bfb_read_packets(uint8_t *buffer, int *length)
 		return NULL;
 	}
 
-	if (*length < (int) sizeof(bfb_frame_t)) {
-		DEBUG(1, "%s() Short packet?\n", __func__);
-		return NULL;
-	}
-	
-	/* temp frame */
-	frame = (bfb_frame_t *)buffer;
-	if ((frame->type ^ frame->len) != frame->chk) {
-		DEBUG(1, "%s() Header error?\n", __func__);
-
-		DEBUGBUFFER(buffer, *length);
-
-		return NULL;
-	}
-
-	if (*length < frame->len + (int) sizeof(bfb_frame_t)) {
-		DEBUG(2, "%s() Need more data?\n", __func__);
+	if (bfb_parse_frame(buffer, *length, &l) == NULL)
 		return NULL;
-	}
 
 	/* copy frame from buffer */
-	l = sizeof(bfb_frame_t) + frame->len;
 	frame = malloc(l);
 	if (frame == NULL)
 		return NULL;
@@ -448,8 +480,7 @@ bfb_frame_t *bfb_read_packets(uint8_t *buffer, int *length)
 	/* remove frame from buffer */
 	*length -= l;
 	memmove(buffer, &buffer[l], *length);
-	
-	DEBUG(3, "%s() Packet 0x%02x (%d bytes)\n", __func__, frame->type, frame->len);
+
 	return frame;
 }
 
@@ -71,6 +71,7 @@ typedef struct {
 #define BFB_KEY_PRESS 0x06        /* ^F */
 
 #define MAX_PACKET_DATA 32
+#define MAX_FRAME_SIZE (3 + 255) /* header and the longest payload */
 #define BFB_DATA_ACK 0x01 /* aka ok */
 #define BFB_DATA_FIRST 0x02 /* first transmission in a row */
 #define BFB_DATA_NEXT 0x03 /* continued transmission */
@@ -107,6 +108,9 @@ int	bfb_send_data(fd_t fd, uint8_t type, uint8_t *data, uint16_t length, uint8_t
 	bfb_send_data(fd, BFB_DATA_NEXT, data, length, seq)
 
 
+/*@null@*/ bfb_frame_t *
+	bfb_parse_frame(uint8_t *buffer, int length, int *used);
+
 /*@null@*/ bfb_frame_t *
 	bfb_read_packets(uint8_t *buffer, int *length);
 
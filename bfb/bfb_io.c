@@ -30,10 +30,15 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <errno.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -78,6 +83,89 @@ int bfb_io_write(fd_t fd, const uint8_t *buffer, int length)
 #endif
 }
 
+#ifndef _WIN32
+/**
+	Wait up to timeout_ms for the port to take more data.
+
+	\return 1 if writable, 0 on timeout, -1 on error
+ */
+static int bfb_io_wait_writable(int fd, int timeout_ms)
+{
+#ifdef HAVE_POLL_H
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret > 0 && !(pfd.revents & POLLOUT))
+		return -1; /* hung up or error */
+	return ret;
+#else
+	struct timeval time;
+	fd_set fdset;
+
+	time.tv_sec = timeout_ms / 1000;
+	time.tv_usec = (timeout_ms % 1000) * 1000;
+
+	FD_ZERO(&fdset);
+	FD_SET(fd, &fdset);
+
+	return select(fd + 1, NULL, &fdset, NULL, &time);
+#endif
+}
+
+/**
+	Write out all of an IO vector. Whenever the port won't take more
+	(EAGAIN on a non-blocking fd) wait for it to drain, but give up if
+	it makes no progress for timeout_ms. The vector is used up in the
+	process.
+
+	\return bytes written, -1 on error or timeout
+ */
+int bfb_io_writev(fd_t fd, struct iovec *iov, int iovcnt, int timeout_ms)
+{
+	ssize_t actual;
+	int total = 0;
+	int ret;
+
+        return_val_if_fail (fd > 0, -1);
+
+	while (iovcnt > 0) {
+		actual = writev(fd, iov, iovcnt);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			DEBUG(1, "%s() Error writing to port (%d bytes written)\n", __func__, total);
+			return -1;
+		}
+		if (actual <= 0) {
+			ret = bfb_io_wait_writable(fd, timeout_ms);
+			if (ret <= 0) {
+				DEBUG(1, "%s() Port %s (%d bytes written)\n", __func__,
+					ret == 0 ? "stalled" : "failed", total);
+				return -1;
+			}
+			continue;
+		}
+
+		total += actual;
+		while (iovcnt > 0 && (size_t) actual >= iov->iov_len) {
+			actual -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + actual;
+			iov->iov_len -= actual;
+		}
+	}
+	return total;
+}
+#endif /* _WIN32 */
+
 /* Read an answer to an IO buffer of max length bytes */
 int bfb_io_read(fd_t fd, uint8_t *buffer, int length, int timeout)
 {
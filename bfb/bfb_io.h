@@ -23,6 +23,11 @@
 #define BFB_IO_H
 
 #include <inttypes.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#define BFB_IO_WRITE_TIMEOUT 1000 /* ms a port may stall a write */
 
 enum trans_type
 {
@@ -40,6 +45,11 @@ extern "C" {
 /* Write out a BFB buffer */
 int	bfb_io_write(fd_t fd, const uint8_t *buffer, int length);
 
+#ifndef _WIN32
+/* Write out all of an IO vector, waiting for the port to drain */
+int	bfb_io_writev(fd_t fd, struct iovec *iov, int iovcnt, int timeout_ms);
+#endif
+
 /* Read in a BFB answer */
 int	bfb_io_read(fd_t fd, uint8_t *buffer, int length, int timeout);
 
@@ -33,6 +33,9 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #include <fcntl.h>
 #include <errno.h>
 
@@ -43,7 +46,6 @@
 #ifdef _WIN32
 #include <windows.h>
 #define sleep(t) Sleep((t) * 1000)
-#define usleep(t) Sleep((t) < 500 ? 1 : ((t) + 500) / 1000);
 #else
 #include <sys/ioctl.h>
 #include <termios.h>
@@ -86,6 +88,111 @@ static void cobex_cleanup(cobex_t *c, int force)
 #endif
 }
 
+#ifndef _WIN32
+/**
+	Bits per second of a tty, 0 if unknown.
+ */
+static int cobex_baudrate(int fd)
+{
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) < 0)
+		return 0;
+	switch (cfgetispeed(&tio)) {
+	case B9600:	return 9600;
+	case B19200:	return 19200;
+	case B38400:	return 38400;
+	case B57600:	return 57600;
+	case B115200:	return 115200;
+#ifdef B230400
+	case B230400:	return 230400;
+#endif
+#ifdef B460800
+	case B460800:	return 460800;
+#endif
+#ifdef B921600
+	case B921600:	return 921600;
+#endif
+	default:	return 0;
+	}
+}
+
+/**
+	Wait up to timeout_ms (-1 for ever) for input.
+
+	\return 1 if there is input, 0 on timeout, -1 on error
+ */
+static int cobex_wait(cobex_t *c, int timeout_ms)
+{
+#ifdef HAVE_POLL_H
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret > 0 && !(pfd.revents & POLLIN))
+		return -1; /* hung up or error */
+	return ret;
+#else
+	struct timeval time;
+	fd_set fdset;
+
+	time.tv_sec = timeout_ms / 1000;
+	time.tv_usec = (timeout_ms % 1000) * 1000;
+
+	FD_ZERO(&fdset);
+	FD_SET(c->fd, &fdset);
+
+	return select(c->fd + 1, &fdset, NULL, NULL, timeout_ms < 0 ? NULL : &time);
+#endif
+}
+
+/**
+	Whether a whole BFB frame is buffered, with more bytes just read.
+ */
+static int cobex_frame_buffered(cobex_t *c, int more)
+{
+	int used;
+
+	return c->type == CT_BFB &&
+		bfb_parse_frame(&c->recv[c->recv_start], c->recv_len + more, &used) != NULL;
+}
+
+/**
+	Read all there is into buf. If no whole BFB frame is buffered
+	yet, the frame under way is given recv_gap ms once to arrive
+	completely, so a steady stream doesn't keep the caller reading.
+
+	\return bytes read, or what the failing read() returned
+ */
+static int cobex_drain(cobex_t *c, uint8_t *buf, int room)
+{
+	int total = 0;
+	int waited = 0;
+	int actual;
+
+	while (total < room) {
+		actual = read(c->fd, buf + total, room - total);
+		if (actual > 0) {
+			total += actual;
+			continue;
+		}
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return total > 0 ? total : actual;
+		if (actual == 0 || waited || c->recv_gap == 0 || cobex_frame_buffered(c, total) ||
+		    cobex_wait(c, c->recv_gap) <= 0)
+			break;
+		waited = 1;
+	}
+	return total;
+}
+#endif /* _WIN32 */
+
 /**
 	Called from OBEX-lib to set up a connection.
  */
@@ -129,6 +236,17 @@ int cobex_connect(obex_t *self, void *data)
 #endif
 		return -1;
 
+#ifndef _WIN32
+	/* time for a full BFB frame on the wire, 10 bits a byte; other
+	   cables are fed to OpenOBEX as a stream and never wait */
+	if (c->type == CT_BFB) {
+		int baud = cobex_baudrate(c->fd);
+		c->recv_gap = baud > 0 ? ((3 + MAX_PACKET_DATA) * 10 * 1000 + baud - 1) / baud : 0;
+		DEBUG(3, "%s() %d baud, waiting %d ms for frames\n", __func__, baud, c->recv_gap);
+	} else
+		c->recv_gap = 0;
+#endif
+
 	return 1;
 }
 
@@ -163,24 +281,19 @@ int cobex_write(obex_t *self, void *data, uint8_t *buffer, int length)
 	DEBUG(3, "%s() Data %d bytes\n", __func__, length);
 
 	if (c->type != CT_BFB) {
-		int retries=0, chunk, fails=0;
-		written = 0;
-		for (retries = 0; written < length; retries++) {
-			chunk = write(c->fd, buffer+written, length-written);
-			if (chunk <= 0) {
-				if ( ++fails >= 10 ) { // to avoid infinite looping if something is really wrong
-					DEBUG(1, "%s() Error writing to port (written %d bytes out of %d, in %d retries)\n", __func__, written, length, retries);
-					return written;
-				}
-				usleep(1); // This mysteriously avoids a resource not available error on write()
-			} else {
-				written += chunk;
-				fails = 0; // Reset error counter on successful write op
-			}
+#ifdef _WIN32
+		written = bfb_io_write(c->fd, buffer, length);
+#else
+		struct iovec iov;
+
+		iov.iov_base = buffer;
+		iov.iov_len = length;
+		written = bfb_io_writev(c->fd, &iov, 1, BFB_IO_WRITE_TIMEOUT);
+#endif
+		if (written < length) {
+			DEBUG(1, "%s() Error writing to port (%d bytes)\n", __func__, length);
+			return -1;
 		}
-		
-		if (retries > 0)
-			DEBUG(2, "%s() Wrote %d bytes in %d retries\n", __func__, written, retries);
 		return written;
 	}
 
@@ -196,6 +309,51 @@ int cobex_write(obex_t *self, void *data, uint8_t *buffer, int length)
 	return written;
 }
 
+/**
+	Feed the BFB frames buffered so far to OpenOBEX.
+
+	Frames are parsed in place. Only a partial frame left at the
+	end of the buffer is moved to its start, to make room for reading.
+
+	\return 1 if a complete OBEX packet was fed, 0 otherwise
+ */
+static int cobex_feed_frames(obex_t *self, cobex_t *c)
+{
+	bfb_frame_t *frame;
+	int used;
+	int actual;
+
+	while ((frame = bfb_parse_frame(&c->recv[c->recv_start], c->recv_len, &used))) {
+		c->recv_start += used;
+		c->recv_len -= used;
+		DEBUG(2, "%s() Parsed %x (%d bytes remaining)\n", __func__, frame->type, c->recv_len);
+
+		(void) bfb_assemble_data(&c->data_buf, &c->data_size, &c->data_len, frame);
+
+		if (bfb_check_data(c->data_buf, c->data_len) == 1) {
+			actual = bfb_send_ack(c->fd);
+			DEBUG(2, "%s() Wrote ack packet (%d)\n", __func__, actual);
+
+			OBEX_CustomDataFeed(self, c->data_buf->data, c->data_len-7);
+			c->data_len = 0;
+
+			if (c->recv_len > 0) {
+				DEBUG(2, "%s() Data remaining after feed, kept for the next call.\n", __func__);
+				DEBUGBUFFER(&c->recv[c->recv_start], c->recv_len);
+			}
+			break;
+		}
+	}
+
+	if (c->recv_len == 0)
+		c->recv_start = 0;
+	else if (c->recv_start + c->recv_len + MAX_FRAME_SIZE > c->recv_size) {
+		memmove(c->recv, &c->recv[c->recv_start], c->recv_len);
+		c->recv_start = 0;
+	}
+	return frame != NULL;
+}
+
 /**
 	Called when input data is needed.
  */
@@ -204,11 +362,10 @@ int cobex_handleinput(obex_t *self, void *data, int timeout)
 #ifdef _WIN32
 	DWORD actual;
 #else
-	struct timeval time;
-	fd_set fdset;
 	int actual;
 #endif
-	bfb_frame_t *frame;
+	uint8_t *buf;
+	int room;
 
 	cobex_t *c;
 
@@ -216,22 +373,40 @@ int cobex_handleinput(obex_t *self, void *data, int timeout)
         return_val_if_fail (data != NULL, -1);
 	c = (cobex_t *) data;
 
+        return_val_if_fail (c->recv != NULL, -1);
+
+	if (c->type == CT_BFB) {
+		if ((c->data_buf == NULL) || (c->data_size == 0)) {
+			c->data_size = 1024;
+			c->data_buf = malloc(c->data_size);
+		}
+		/* a packet may be waiting from the last read */
+		if (c->recv_len > 0 && cobex_feed_frames(self, c))
+			return 1;
+	}
+
+	room = c->recv_size - c->recv_start - c->recv_len;
+	if (room == 0) {
+		/* no frame in a full buffer, out of sync */
+		DEBUG(1, "%s() Dropping %d bytes of garbage\n", __func__, c->recv_len);
+		c->recv_start = 0;
+		c->recv_len = 0;
+		room = c->recv_size;
+	}
+	buf = &c->recv[c->recv_start + c->recv_len];
+
 #ifdef _WIN32
-	if (!ReadFile(c->fd, &(c->recv[c->recv_len]), sizeof(c->recv) - c->recv_len, &actual, NULL))
+	if (!ReadFile(c->fd, buf, room, &actual, NULL))
 		DEBUG(2, "%s() Read error: %ld\n", __func__, actual);
 
 	DEBUG(2, "%s() Read %ld bytes (%d bytes already buffered)\n", __func__, actual, c->recv_len);
 	/* FIXME ... */
 #else
-	time.tv_sec = timeout;
-	time.tv_usec = 0;
-
-	/* Add the fd's to the set. */
-	FD_ZERO(&fdset);
-	FD_SET(c->fd, &fdset);
-
 	/* Wait for input */
-	actual = select(c->fd + 1, &fdset, NULL, NULL, &time);
+	if (c->timeout_ms >= 0)
+		actual = cobex_wait(c, c->timeout_ms);
+	else
+		actual = cobex_wait(c, timeout < 0 ? -1 : timeout * 1000);
 
 	DEBUG(2, "%s() There is something (%d)\n", __func__, actual);
 
@@ -239,56 +414,24 @@ int cobex_handleinput(obex_t *self, void *data, int timeout)
 	if(actual <= 0)
 		return actual;
 
-	actual = read(c->fd, &(c->recv[c->recv_len]), sizeof(c->recv) - c->recv_len);
+	actual = cobex_drain(c, buf, room);
 	DEBUG(2, "%s() Read %d bytes (%d bytes already buffered)\n", __func__, actual, c->recv_len);
 #endif
 
 	if (c->type != CT_BFB) {
 		if (actual > 0) {
-			OBEX_CustomDataFeed(self, c->recv, actual);
+			OBEX_CustomDataFeed(self, buf, actual);
 			return 1;
 		}
 		return actual;
 	}
 
-	if ((c->data_buf == NULL) || (c->data_size == 0)) {
-		c->data_size = 1024;
-		c->data_buf = malloc(c->data_size);
-	}
-
 	if (actual > 0) {
 		c->recv_len += actual;
-		DEBUGBUFFER(c->recv, c->recv_len);
-
-		while ((frame = bfb_read_packets(c->recv, &(c->recv_len)))) {
-			DEBUG(2, "%s() Parsed %x (%d bytes remaining)\n", __func__, frame->type, c->recv_len);
-
-			(void) bfb_assemble_data(&c->data_buf, &c->data_size, &c->data_len, frame);
-
-			if (bfb_check_data(c->data_buf, c->data_len) == 1) {
-				actual = bfb_send_ack(c->fd);
-#ifdef _WIN32
-				DEBUG(2, "%s() Wrote ack packet (%ld)\n", __func__, actual);
-#else
-				DEBUG(2, "%s() Wrote ack packet (%d)\n", __func__, actual);
-#endif
-
-				OBEX_CustomDataFeed(self, c->data_buf->data, c->data_len-7);
-				/*
-				free(c->data);
-				c->data = NULL;
-				*/
-				c->data_len = 0;
-
-				if (c->recv_len > 0) {
-					DEBUG(2, "%s() Data remaining after feed, this can't be good.\n", __func__);
-					DEBUGBUFFER(c->recv, c->recv_len);
-				}
-
-				return 1;
-			}
-		}
+		DEBUGBUFFER(&c->recv[c->recv_start], c->recv_len);
 
+		if (cobex_feed_frames(self, c))
+			return 1;
 	}
 	return actual;
 }
@@ -318,6 +461,9 @@ obex_ctrans_t *cobex_ctrans (const char *tty) {
 	if(tty == NULL)
 		tty = SERPORT;
 	cobex->tty = strdup (tty);
+	cobex->recv_size = RECVSIZE;
+	cobex->recv = malloc (cobex->recv_size);
+	cobex->timeout_ms = -1;
 
 	ctrans = calloc (1, sizeof(obex_ctrans_t));
 	ctrans->connect = cobex_connect;
@@ -344,11 +490,73 @@ void cobex_free (obex_ctrans_t *ctrans)
 	return_if_fail (cobex != NULL);
 
 	free (cobex->tty);
-	/* maybe there is a bfb_data_t left? */
-	/* free(cobex->data); */
+	free (cobex->recv);
+	free (cobex->data_buf);
 
 	free (cobex);
 	free (ctrans);
 
 	return;
 }
+
+
+/**
+	Set the size of the receive buffer of a multi cobex instance.
+
+	A larger buffer takes more per read at high baud rates. Data
+	already buffered is kept.
+
+	\param ctrans a multi cobex instance from cobex_ctrans()
+	\param size buffer size in bytes, at least two BFB frames
+	\return 0 on success, -1 on error
+ */
+int cobex_set_recvsize (obex_ctrans_t *ctrans, int size)
+{
+	cobex_t *cobex;
+	uint8_t *recv;
+
+	return_val_if_fail (ctrans != NULL, -1);
+	cobex = (cobex_t *)ctrans->customdata;
+	return_val_if_fail (cobex != NULL, -1);
+
+	if (size < RECVSIZE_MIN)
+		size = RECVSIZE_MIN;
+	if (size < cobex->recv_len)
+		return -1;
+
+	recv = malloc (size);
+	if (recv == NULL)
+		return -1;
+	if (cobex->recv_len > 0)
+		memcpy (recv, &cobex->recv[cobex->recv_start], cobex->recv_len);
+	free (cobex->recv);
+	cobex->recv = recv;
+	cobex->recv_size = size;
+	cobex->recv_start = 0;
+
+	return 0;
+}
+
+
+/**
+	Set the input timeout of a multi cobex instance.
+
+	OpenOBEX passes whole seconds to the transport. This allows for
+	shorter waits on interactive operations.
+
+	\param ctrans a multi cobex instance from cobex_ctrans()
+	\param timeout_ms milliseconds to wait for input, -1 to use the
+		timeout given to OBEX_HandleInput()
+	\return 0 on success, -1 on error
+ */
+int cobex_set_timeout (obex_ctrans_t *ctrans, int timeout_ms)
+{
+	cobex_t *cobex;
+
+	return_val_if_fail (ctrans != NULL, -1);
+	cobex = (cobex_t *)ctrans->customdata;
+	return_val_if_fail (cobex != NULL, -1);
+
+	cobex->timeout_ms = timeout_ms < 0 ? -1 : timeout_ms;
+	return 0;
+}
@@ -34,6 +34,8 @@ extern "C" {
 obex_ctrans_t *
 	cobex_ctrans (const char *tty);
 void	cobex_free (obex_ctrans_t * ctrans);
+int	cobex_set_recvsize (obex_ctrans_t * ctrans, int size);
+int	cobex_set_timeout (obex_ctrans_t * ctrans, int timeout_ms);
 
 /* callbacks */
 
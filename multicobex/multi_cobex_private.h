@@ -27,7 +27,8 @@
 
 #define SERPORT "/dev/ttyS0"
 
-#define	RECVSIZE 500		/* Recieve up to this much from socket */
+#define	RECVSIZE 16384		/* Default receive buffer, see cobex_set_recvsize() */
+#define	RECVSIZE_MIN (2 * MAX_FRAME_SIZE)
 
 enum cobex_type
 {
@@ -46,8 +47,12 @@ typedef struct {
 #else
 	int fd;			/* Socket descriptor */
 #endif
-	uint8_t recv[RECVSIZE];	/* Buffer socket input */
-	int recv_len;
+	uint8_t *recv;		/* Buffer socket input, frames are parsed in place */
+	int recv_size;		/* allocated */
+	int recv_start;		/* first unparsed byte */
+	int recv_len;		/* unparsed bytes from there */
+	int recv_gap;		/* ms to wait for the rest of a frame */
+	int timeout_ms;		/* input timeout, -1 uses OpenOBEX's seconds */
 	uint8_t seq;
 	bfb_data_t *data_buf;	/* assembled obex frames */
 	int data_size;		/* max buffer size */
@@ -228,104 +228,214 @@ static time_t atotime (const char *date)
 {
 	struct tm tm;
 
+	memset(&tm, 0, sizeof(tm));
 	if (6 == sscanf(date, "%4d%2d%2dT%2d%2d%2d",
 			&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
 			&tm.tm_hour, &tm.tm_min, &tm.tm_sec)) {
 		tm.tm_year -= 1900;
 		tm.tm_mon--;
-	}
+	} else
+		return 0;
 	tm.tm_isdst = 0;
 
 	return mktime(&tm);
 }
 
+/**
+	Copy at most \a size - 1 bytes of UTF-8, never splitting a character.
+ */
+static void utf8_strlcpy(char *dest, const char *src, int len, int size)
+{
+	if (len > size - 1) {
+		len = size - 1;
+		/* back up to the start of a character */
+		while (len > 0 && (src[len] & 0xc0) == 0x80)
+			len--;
+	}
+	memcpy(dest, src, len);
+	dest[len] = '\0';
+}
+
+/**
+	Decode XML character and entity references in place.
+	Numeric references are stored as UTF-8, unknown entities are kept.
+ */
+static void xml_unescape(char *s)
+{
+	static const struct { const char *name; char c; } entities[] = {
+		{ "amp;", '&' }, { "lt;", '<' }, { "gt;", '>' },
+		{ "quot;", '"' }, { "apos;", '\'' }, { NULL, 0 }
+	};
+	char *in, *out, *end;
+	unsigned long cp;
+	int i, n;
+
+	for (in = out = s; *in; ) {
+		if (*in != '&') {
+			*out++ = *in++;
+			continue;
+		}
+		if (in[1] == '#') {
+			if (in[2] == 'x' || in[2] == 'X')
+				cp = strtoul(in + 3, &end, 16);
+			else
+				cp = strtoul(in + 2, &end, 10);
+			if (*end == ';' && end > in + 2 && cp > 0 && cp <= 0x10ffff) {
+				if (cp < 0x80) {
+					*out++ = cp;
+				} else if (cp < 0x800) {
+					*out++ = 0xc0 | (cp >> 6);
+					*out++ = 0x80 | (cp & 0x3f);
+				} else if (cp < 0x10000) {
+					*out++ = 0xe0 | (cp >> 12);
+					*out++ = 0x80 | ((cp >> 6) & 0x3f);
+					*out++ = 0x80 | (cp & 0x3f);
+				} else {
+					*out++ = 0xf0 | (cp >> 18);
+					*out++ = 0x80 | ((cp >> 12) & 0x3f);
+					*out++ = 0x80 | ((cp >> 6) & 0x3f);
+					*out++ = 0x80 | (cp & 0x3f);
+				}
+				in = end + 1;
+				continue;
+			}
+		}
+		for (i = 0; entities[i].name; i++) {
+			n = strlen(entities[i].name);
+			if (!strncmp(in + 1, entities[i].name, n)) {
+				*out++ = entities[i].c;
+				in += n + 1;
+				break;
+			}
+		}
+		if (!entities[i].name)
+			*out++ = *in++;
+	}
+	*out = '\0';
+}
+
+/**
+	Find an attribute inside a tag and copy its raw value.
+	\param tag points just after the tag name
+	\param end points to the closing '>'
+	\return the value length, -1 if the attribute isn't present
+ */
+static int xml_attr(const char *tag, const char *end, const char *attr, char *val, int size)
+{
+	const char *p, *name, *value;
+	int name_len, len;
+	char quote;
+
+	for (p = tag; p < end; ) {
+		while (p < end && strchr(" \t\r\n/", *p))
+			p++;
+		name = p;
+		while (p < end && *p != '=' && !strchr(" \t\r\n", *p))
+			p++;
+		name_len = p - name;
+		while (p < end && strchr(" \t\r\n", *p))
+			p++;
+		if (p >= end || *p != '=')
+			continue;
+		p++;
+		while (p < end && strchr(" \t\r\n", *p))
+			p++;
+		if (p >= end || (*p != '"' && *p != '\''))
+			return -1; /* malformed */
+		quote = *p++;
+		value = p;
+		while (p < end && *p != quote)
+			p++;
+		len = p - value;
+		p++;
+		if (name_len == (int) strlen(attr) && !strncmp(name, attr, name_len)) {
+			utf8_strlcpy(val, value, len, size);
+			return len;
+		}
+	}
+	return -1;
+}
+
 /**
 	Parse an XML file to array of stat_entry_t's.
-	Very limited - not multi-byte character save.
-	It's actually "const char *xml" but can't be declared as such.
+	The listing is read as UTF-8 and names are kept as UTF-8,
+	use obexftp_stat_localname() to convert them to the locale charset.
 	\return a new allocated array of stat_entry_t's.
  */
-static stat_entry_t *parse_directory(char *xml)
+static stat_entry_t *parse_directory(const char *xml)
 {
-        const char *line;
-        const char *p, *h;
-        char tagname[201];
-        char name[201]; // bad coder
-        char mod[201]; // - no biscuits!
-        char size[201]; // int would be ok too.
+	const char *p, *tag, *end;
+	char tagname[201];
+	char name[sizeof(((stat_entry_t *)0)->name) * 6]; /* room for entities */
+	char mod[201];
+	char size[201];
+	int tagname_len;
 
 	stat_entry_t *dir_start, *dir;
-	int ret, n, i;
-	char *xml_conv;
-		
+	int i;
+
 	if (!xml)
 		return NULL;
-	n = strlen(xml) + 1;
-	xml_conv = malloc(n);
-	ret = Utf8ToChar(xml_conv, xml, n);
-       	if (ret > 0) {
-       		xml = xml_conv;
-       	} else {
-       		DEBUG(1, "UTF-8 conversion error\n");
-       	}
-	
-	DEBUG(4, "Converted cache xml: '%s'\n", xml);
+
 	/* prepare a cache to hold this dir */
-	p = xml;
-	for (i = 0; p && *p; p = strchr(++p, '>')) i++;
+	for (i = 1, p = xml; (p = strchr(p, '<')); p++) i++;
 	DEBUG(2, "max %d cache lines\n", i);
 	dir_start = dir = calloc(i, sizeof(stat_entry_t));
+	if (!dir_start)
+		return NULL;
 
-        for (line = xml; *line != '\0'; ) {
-		
-		p = line;
-                line = strchr(line, '>');
-		if (!line)
+	for (p = xml; (tag = strchr(p, '<')); p = end + 1) {
+		/* find the end of the tag, '>' is valid in quoted values */
+		for (end = tag + 1; *end && *end != '>'; end++) {
+			if (*end == '"' || *end == '\'') {
+				const char *q = strchr(end + 1, *end);
+				if (!q)
+					break;
+				end = q;
+			}
+		}
+		if (*end != '>')
 			break;
-		line++;
-		while (*p != '<') p++;
-		
-		tagname[0] = '\0';
-                sscanf (p, "<%200[^> \t\n\r] ", tagname);
-
-                name[0] = '\0';
-		h = strstr(p, "name=");
-		if (h) sscanf (h, "name=\"%200[^\"]\"", name);
-                
+
+		tag++;
+		for (tagname_len = 0; tag + tagname_len < end &&
+				!strchr(" \t\r\n/", tag[tagname_len]); tagname_len++);
+		if (tagname_len >= (int) sizeof(tagname))
+			continue;
+		memcpy(tagname, tag, tagname_len);
+		tagname[tagname_len] = '\0';
+		tag += tagname_len;
+
+		if (strcmp("folder", tagname) && strcmp("file", tagname))
+			continue; /* handle hidden folder! */
+
+		if (xml_attr(tag, end, "name", name, sizeof(name)) < 0)
+			continue;
+		xml_unescape(name);
+
 		mod[0] = '\0';
-                h = strstr(p, "modified=");
-		if (h) sscanf (h, "modified=\"%200[^\"]\"", mod);
-                
+		(void) xml_attr(tag, end, "modified", mod, sizeof(mod));
+
 		size[0] = '\0';
-                h = strstr(p, "size=");
-		if (h) sscanf (h, "size=\"%200[^\"]\"", size);
-	
+		(void) xml_attr(tag, end, "size", size, sizeof(size));
+
+		utf8_strlcpy(dir->name, name, strlen(name), sizeof(dir->name));
+		dir->mtime = atotime(mod);
 		if (!strcmp("folder", tagname)) {
-                        dir->mode = S_IFDIR | 0755;
-                        strcpy(dir->name, name);
-			dir->mtime = atotime(mod);
-                        dir->size = 0;
-			dir++;
-                }
-		if (!strcmp("file", tagname)) {
-                        dir->mode = S_IFREG | 0644;
-                        strcpy(dir->name, name);
-			dir->mtime = atotime(mod);
+			dir->mode = S_IFDIR | 0755;
+			dir->size = 0;
+		} else {
+			dir->mode = S_IFREG | 0644;
 			i = 0;
 			sscanf(size, "%i", &i);
 			dir->size = i; /* int to off_t */
-			dir++;
-                }
-                // handle hidden folder!
-
-        }
+		}
+		dir++;
+	}
 
 	dir->name[0] = '\0';
 
-	if (xml_conv)
-		free (xml_conv);
-
-        return dir_start;
+	return dir_start;
 }
 
 
@@ -393,8 +503,37 @@ stat_entry_t *obexftp_readdir(void *dir) {
 	return stream->cur++;
 }
 	 
+/**
+	Convert the (UTF-8) name of a directory entry to the locale charset.
+
+	\param entry a stat entry from obexftp_readdir() or obexftp_stat()
+	\param buf buffer for the converted name
+	\param size size of the buffer
+
+	\return the length of the converted name, -1 on error
+ */
+int obexftp_stat_localname(const stat_entry_t *entry, char *buf, int size)
+{
+	int len;
+
+	return_val_if_fail(entry != NULL, -1);
+	return_val_if_fail(buf != NULL && size > 0, -1);
+
+	len = Utf8ToChar((uint8_t *) buf, (const uint8_t *) entry->name, size - 1);
+	if (len < 0)
+		return -1;
+	/* some conversions count the terminator, or what didn't fit */
+	if (len > size - 1)
+		len = size - 1;
+	buf[len] = '\0';
+	return strlen(buf);
+}
+
 /**
 	Stat a directory entry.
+
+	Names in the listing are UTF-8, the name looked up may be UTF-8 or
+	in the locale charset.
  */
 stat_entry_t *obexftp_stat(obexftp_client_t *cli, const char *name)
 {
@@ -402,6 +541,8 @@ stat_entry_t *obexftp_stat(obexftp_client_t *cli, const char *name)
 	stat_entry_t *entry;
 	char *path, *abs, *p;
 	const char *basename;
+	char key[sizeof(((stat_entry_t *)0)->name)];
+	int len;
 
 	return_val_if_fail(name != NULL, NULL);
 
@@ -434,8 +575,14 @@ stat_entry_t *obexftp_stat(obexftp_client_t *cli, const char *name)
 		cache->stats = parse_directory(cache->content);
 	DEBUG(2, "%s() got dir '%s'\n", __func__, path);
 	
-	/* then lookup the basename */
-	for (entry = cache->stats; entry && *entry->name && strcmp(entry->name, basename); entry++);
+	/* then lookup the basename, as UTF-8 */
+	len = CharToUtf8((uint8_t *) key, (const uint8_t *) basename, sizeof(key) - 1);
+	if (len < 0) {
+		free(path);
+		return NULL;
+	}
+	key[len] = '\0';
+	for (entry = cache->stats; entry && *entry->name && strcmp(entry->name, key); entry++);
 	free(path);
 	if (!entry || !(*entry->name))
 		return NULL;
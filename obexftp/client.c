@@ -450,6 +450,12 @@ static int cli_sync_request(obexftp_client_t *cli, obex_object_t *object)
 	if (cli->finished == FALSE)
 		return -EBUSY;
 	cli->finished = FALSE;
+#ifdef HAVE_OBEX_SETREPONSEMODE
+	/* OpenOBEX adds the SRM header to GET and PUT and drops back to
+	   one response per packet if the peer does not confirm it */
+	OBEX_SetReponseMode(cli->obexhandle, OBEXFTP_USE_SRM(cli->quirks) ?
+				OBEX_RSP_MODE_SINGLE : OBEX_RSP_MODE_NORMAL);
+#endif
 	(void) OBEX_Request(cli->obexhandle, object);
 
 	return obexftp_sync (cli);
@@ -516,6 +522,14 @@ obexftp_client_t *obexftp_open(int transport, /*const*/ obex_ctrans_t *ctrans, o
 		return NULL;
 	}
 
+	/* Buffers for requests */
+	cli->builder = obexftp_builder_new();
+	if(cli->builder == NULL) {
+		free(cli->stream_chunk);
+		free(cli);
+		return NULL;
+	}
+
 	return cli;
 }
 
@@ -541,6 +555,7 @@ void obexftp_close(obexftp_client_t *cli)
 		free(cli->buf_data);
 	}
 	cache_purge(&cli->cache, NULL);
+	obexftp_builder_free(cli->builder);
 	free(cli->stream_chunk);
 	free(cli);
 }
@@ -880,12 +895,12 @@ int obexftp_get_type(obexftp_client_t *cli, const char *type, const char *localn
 		}
 
 		DEBUG(2, "%s() Getting %s -> %s (%s)\n", __func__, basename, localname, type);
-		object = obexftp_build_get (cli->obexhandle, cli->connection_id, basename, type);
+		object = obexftp_builder_get (cli->builder, cli->obexhandle, cli->connection_id, basename, type);
 		free(basepath);
 		free(basename);
 	} else {
 		DEBUG(2, "%s() Getting %s -> %s (%s)\n", __func__, remotename, localname, type);
-		object = obexftp_build_get (cli->obexhandle, cli->connection_id, remotename, type);
+		object = obexftp_builder_get (cli->builder, cli->obexhandle, cli->connection_id, remotename, type);
 	}
 
 	if(object == NULL)
@@ -922,7 +937,7 @@ int obexftp_rename(obexftp_client_t *cli, const char *sourcename, const char *ta
 
 	DEBUG(2, "%s() Moving %s -> %s\n", __func__, sourcename, targetname);
 
-        object = obexftp_build_rename (cli->obexhandle, cli->connection_id, sourcename, targetname);
+        object = obexftp_builder_rename (cli->builder, cli->obexhandle, cli->connection_id, sourcename, targetname);
         if(object == NULL)
                 return -1;
 	
@@ -938,6 +953,95 @@ int obexftp_rename(obexftp_client_t *cli, const char *sourcename, const char *ta
 }
 
 
+/**
+	Send an OBEX ACTION request, acting on the server without
+	transferring the file.
+ */
+static int cli_action(obexftp_client_t *cli, uint8_t action, const char *name, const char *dest, uint32_t perms)
+{
+	obex_object_t *object = NULL;
+	int ret;
+
+	return_val_if_fail(cli != NULL, -EINVAL);
+
+	cli->infocb(OBEXFTP_EV_SENDING, name, 0, cli->infocb_data);
+
+	switch (action) {
+	case OBEXFTP_ACTION_COPY:
+		DEBUG(2, "%s() Copying %s -> %s\n", __func__, name, dest);
+		object = obexftp_builder_copy (cli->builder, cli->obexhandle, cli->connection_id, name, dest);
+		break;
+	case OBEXFTP_ACTION_MOVE:
+		DEBUG(2, "%s() Moving %s -> %s\n", __func__, name, dest);
+		object = obexftp_builder_move (cli->builder, cli->obexhandle, cli->connection_id, name, dest);
+		break;
+	case OBEXFTP_ACTION_SETPERM:
+		DEBUG(2, "%s() Setting permissions of %s to %06x\n", __func__, name, perms);
+		object = obexftp_builder_setperm (cli->builder, cli->obexhandle, cli->connection_id, name, perms);
+		break;
+	}
+	if(object == NULL)
+		return -1;
+
+	cache_purge(&cli->cache, NULL);
+	ret = cli_sync_request(cli, object);
+
+	if(ret < 0)
+		cli->infocb(OBEXFTP_EV_ERR, name, 0, cli->infocb_data);
+	else
+		cli->infocb(OBEXFTP_EV_OK, name, 0, cli->infocb_data);
+
+	return ret;
+}
+
+
+/**
+	Have the server copy a file (OBEX 1.5 ACTION).
+
+	\param cli an obexftp_client_t created by obexftp_open().
+	\param sourcename remote filename to be copied
+	\param targetname remote filename of the copy
+
+	\return the result of the ACTION request
+ */
+int obexftp_copy(obexftp_client_t *cli, const char *sourcename, const char *targetname)
+{
+	return cli_action(cli, OBEXFTP_ACTION_COPY, sourcename, targetname, 0);
+}
+
+
+/**
+	Have the server move or rename a file or folder (OBEX 1.5 ACTION).
+
+	\param cli an obexftp_client_t created by obexftp_open().
+	\param sourcename remote filename to be moved
+	\param targetname remote target filename
+
+	\return the result of the ACTION request
+
+	\note Siemens devices want obexftp_rename() instead.
+ */
+int obexftp_move(obexftp_client_t *cli, const char *sourcename, const char *targetname)
+{
+	return cli_action(cli, OBEXFTP_ACTION_MOVE, sourcename, targetname, 0);
+}
+
+
+/**
+	Set the permissions of a remote file or folder (OBEX 1.5 ACTION).
+
+	\param cli an obexftp_client_t created by obexftp_open().
+	\param name remote filename
+	\param perms OBEXFTP_PERM_ bits, see OBEXFTP_PERM_USER() and friends
+
+	\return the result of the ACTION request
+ */
+int obexftp_setperm(obexftp_client_t *cli, const char *name, uint32_t perms)
+{
+	return cli_action(cli, OBEXFTP_ACTION_SETPERM, name, NULL, perms);
+}
+
+
 /**
 	Send an OBEX PUT with empty file name (delete).
 
@@ -966,12 +1070,12 @@ int obexftp_del(obexftp_client_t *cli, const char *name)
 		}
 
 		DEBUG(2, "%s() Deleting %s\n", __func__, basename);
-		object = obexftp_build_del (cli->obexhandle, cli->connection_id, basename);
+		object = obexftp_builder_del (cli->builder, cli->obexhandle, cli->connection_id, basename);
 		free(basepath);
 		free(basename);
 	} else {
 		DEBUG(2, "%s() Deleting %s\n", __func__, name);
-		object = obexftp_build_del (cli->obexhandle, cli->connection_id, name);
+		object = obexftp_builder_del (cli->builder, cli->obexhandle, cli->connection_id, name);
 	}
 
 	if(object == NULL)
@@ -1022,11 +1126,11 @@ int obexftp_setpath(obexftp_client_t *cli, const char *name, int create)
 			cli->infocb(OBEXFTP_EV_SENDING, tail, 0, cli->infocb_data);
 			DEBUG(2, "%s() Setpath \"%s\" (create:%d)\n", __func__, tail, create);
 			/* try without the create flag */
-			object = obexftp_build_setpath (cli->obexhandle, cli->connection_id, tail, 0);
+			object = obexftp_builder_setpath (cli->builder, cli->obexhandle, cli->connection_id, tail, 0);
 			ret = cli_sync_request(cli, object);
 			if ((ret < 0) && create) {
 				/* try again with create flag set maybe? */
-				object = obexftp_build_setpath (cli->obexhandle, cli->connection_id, tail, 1);
+				object = obexftp_builder_setpath (cli->builder, cli->obexhandle, cli->connection_id, tail, 1);
 				ret = cli_sync_request(cli, object);
 			}
 			if (ret < 0) break;
@@ -1042,7 +1146,7 @@ int obexftp_setpath(obexftp_client_t *cli, const char *name, int create)
 	} else {
 		cli->infocb(OBEXFTP_EV_SENDING, name, 0, cli->infocb_data);
 		DEBUG(2, "%s() Setpath \"%s\"\n", __func__, name);
-		object = obexftp_build_setpath (cli->obexhandle, cli->connection_id, name, create);
+		object = obexftp_builder_setpath (cli->builder, cli->obexhandle, cli->connection_id, name, create);
 		ret = cli_sync_request(cli, object);
 	}
 	if (create)
@@ -1100,12 +1204,12 @@ int obexftp_put_file(obexftp_client_t *cli, const char *filename, const char *re
 		}
 
 		DEBUG(2, "%s() Sending %s -> %s\n", __func__, filename, basename);
-		object = build_object_from_file (cli->obexhandle, cli->connection_id, filename, basename);
+		object = build_object_from_file (cli->builder, cli->obexhandle, cli->connection_id, filename, basename);
 		free(basepath);
 		free(basename);
 	} else {
 		DEBUG(2, "%s() Sending %s -> %s\n", __func__, filename, remotename);
-		object = build_object_from_file (cli->obexhandle, cli->connection_id, filename, remotename);
+		object = build_object_from_file (cli->builder, cli->obexhandle, cli->connection_id, filename, remotename);
 	}
 	
 	cli->fd = open(filename, O_RDONLY | O_BINARY, 0);
@@ -1165,12 +1269,12 @@ int obexftp_put_data(obexftp_client_t *cli, const char *data, int size,
 		}
 
 		DEBUG(2, "%s() Sending memdata -> %s\n", __func__, basename);
-		object = obexftp_build_put (cli->obexhandle, cli->connection_id, basename, size);
+		object = obexftp_builder_put (cli->builder, cli->obexhandle, cli->connection_id, basename, size);
 		free(basepath);
 		free(basename);
 	} else {
 		DEBUG(2, "%s() Sending memdata -> %s\n", __func__, remotename);
-		object = obexftp_build_put (cli->obexhandle, cli->connection_id, remotename, size);
+		object = obexftp_builder_put (cli->builder, cli->obexhandle, cli->connection_id, remotename, size);
 	}
 
 	cli->out_data = data; /* memcpy would be safer */
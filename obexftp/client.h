@@ -44,22 +44,24 @@ extern "C" {
 #define OBEXFTP_TRAILING_SLASH	0x02	/* used in list */
 #define OBEXFTP_SPLIT_SETPATH	0x04	/* some phones dont have a cwd */
 #define OBEXFTP_CONN_HEADER	0x08	/* do we even need this? */
+#define OBEXFTP_SRM		0x10	/* ask for single response mode */
 
 #define OBEXFTP_USE_LEADING_SLASH(x)	((x & OBEXFTP_LEADING_SLASH) != 0)
 #define OBEXFTP_USE_TRAILING_SLASH(x)	((x & OBEXFTP_TRAILING_SLASH) != 0)
 #define OBEXFTP_USE_SPLIT_SETPATH(x)	((x & OBEXFTP_SPLIT_SETPATH) != 0)
 #define OBEXFTP_USE_CONN_HEADER(x)	((x & OBEXFTP_CONN_HEADER) != 0)
+#define OBEXFTP_USE_SRM(x)		((x & OBEXFTP_SRM) != 0)
 
 /* dont disable leading slashes unless you disable split setpath */
 #define DEFAULT_OBEXFTP_QUIRKS	\
-	(OBEXFTP_LEADING_SLASH | OBEXFTP_TRAILING_SLASH | OBEXFTP_SPLIT_SETPATH | OBEXFTP_CONN_HEADER)
+	(OBEXFTP_LEADING_SLASH | OBEXFTP_TRAILING_SLASH | OBEXFTP_SPLIT_SETPATH | OBEXFTP_CONN_HEADER | OBEXFTP_SRM)
 #define DEFAULT_CACHE_TIMEOUT 180	/* 3 minutes */
 #define DEFAULT_CACHE_MAXSIZE 10240	/* 10k */
 
 /* types */
 
 typedef struct {
-	char name[256];
+	char name[256];	/* UTF-8 */
 	mode_t mode;
 	int size;
 	time_t mtime;
@@ -102,6 +104,8 @@ typedef struct {
 	uint32_t buf_size; /* not size but len... */
 	uint8_t *buf_data;
 	uint32_t apparam_info;
+	/* requests */
+	obexftp_builder_t *builder;
 	/* persistence */
 	cache_object_t *cache;
 	int cache_timeout;
@@ -189,6 +193,16 @@ int obexftp_put_data(obexftp_client_t *cli, const char *data, int size,
 
 int obexftp_del(obexftp_client_t *cli, const char *name);
 
+int obexftp_copy(obexftp_client_t *cli,
+		 const char *sourcename,
+		 const char *targetname);
+
+int obexftp_move(obexftp_client_t *cli,
+		 const char *sourcename,
+		 const char *targetname);
+
+int obexftp_setperm(obexftp_client_t *cli, const char *name, uint32_t perms);
+
 
 /* Siemens only */
 
@@ -209,6 +223,8 @@ stat_entry_t *obexftp_readdir(void *dir);
 
 stat_entry_t *obexftp_stat(obexftp_client_t *cli, const char *name);
 
+int obexftp_stat_localname(const stat_entry_t *entry, char *buf, int size);
+
 
 #ifdef __cplusplus
 }
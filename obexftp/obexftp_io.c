@@ -32,6 +32,7 @@
 
 #include <openobex/obex.h>
 
+#include "object.h"
 #include "obexftp_io.h"
 #include <common.h>
 
@@ -63,52 +64,18 @@ static int get_fileinfo(const char *name, char *lastmod)
 
 
 /* Create an object from a file. Attach some info-headers to it */
-obex_object_t *build_object_from_file(obex_t *obex, uint32_t conn, const char *localname, const char *remotename)
+obex_object_t *build_object_from_file(obexftp_builder_t *builder, obex_t *obex, uint32_t conn, const char *localname, const char *remotename)
 {
 	obex_object_t *object;
-	obex_headerdata_t hv;
-	uint8_t *ucname;
-	int ucname_len, size;
+	int size;
 	char lastmod[] = "11997700--0011--0011TT0000::0000::0000ZZ.";
 		
 	/* Get filesize and modification-time */
 	size = get_fileinfo(localname, lastmod);
 
-	object = OBEX_ObjectNew(obex, OBEX_CMD_PUT);
-	if(object == NULL)
-		return NULL;
-
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
-
-	ucname_len = strlen(remotename)*2 + 2;
-	ucname = malloc(ucname_len);
-	if(ucname == NULL) {
-		(void) OBEX_ObjectDelete(obex, object);
-		return NULL;
-	}
-
-	ucname_len = OBEX_CharToUnicode(ucname, (uint8_t*)remotename, ucname_len);
-
-	hv.bs = ucname;
-	(void ) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, 0);
-	free(ucname);
-
-	hv.bq4 = (const uint32_t) size;
-	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_LENGTH, hv, sizeof(uint32_t), 0);
-
-#if 0
-	/* Win2k excpects this header to be in unicode. I suspect this in
+	/* Win2k excpects a TIME header to be in unicode. I suspect this in
 	   incorrect so this will have to wait until that's investigated */
-	hv.bs = (const uint8_t *) lastmod;
-	OBEX_ObjectAddHeader(obex, object, OBEX_HDR_TIME, hv, strlen(lastmod)+1, 0);
-#endif
-		
-	hv.bs = (const uint8_t *) NULL;
-	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_BODY,
-				hv, 0, OBEX_FL_STREAM_START);
+	object = obexftp_builder_put(builder, obex, conn, remotename, size);
 
 	DEBUG(3, "%s() Lastmod = %s\n", __func__, lastmod);
 	return object;
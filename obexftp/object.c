@@ -27,6 +27,123 @@
 #include "object.h"
 
 
+/**
+	Make sure a buffer holds at least \a size bytes.
+	Buffers only ever grow, so a warmed up builder doesn't allocate.
+ */
+static int grow_buffer(void **buf, int *buf_size, int size)
+{
+	void *p;
+
+	if (*buf_size >= size)
+		return 0;
+	p = realloc(*buf, size);
+	if (p == NULL)
+		return -1;
+	*buf = p;
+	*buf_size = size;
+	return 0;
+}
+
+
+/**
+	Encode a name to UTF-16BE, reusing earlier results.
+	\return the encoded length (including the trailing 0), -1 on error
+ */
+static int builder_encode_name(obexftp_builder_t *builder, const char *name, const uint8_t **ucname)
+{
+	obexftp_name_cache_t *entry, *victim;
+	int name_len, i;
+
+	builder->clock++;
+	victim = &builder->names[0];
+	for (i = 0; i < OBEXFTP_NAME_CACHE_SIZE; i++) {
+		entry = &builder->names[i];
+		if (entry->name && entry->ucname_len > 0 && !strcmp(entry->name, name)) {
+			entry->used = builder->clock;
+			*ucname = entry->ucname;
+			return entry->ucname_len;
+		}
+		if (entry->used < victim->used)
+			victim = entry;
+	}
+
+	/* replace the least recently used entry */
+	name_len = strlen(name);
+	victim->ucname_len = 0;
+	if (grow_buffer((void **)&victim->name, &victim->name_size, name_len + 1) < 0 ||
+	    grow_buffer((void **)&victim->ucname, &victim->ucname_size, name_len*2 + 2) < 0)
+		return -1;
+	memcpy(victim->name, name, name_len + 1);
+	victim->ucname_len = CharToUnicode(victim->ucname, (const uint8_t *)name, victim->ucname_size);
+	if (victim->ucname_len < 0) {
+		victim->ucname_len = 0;
+		return -1;
+	}
+	victim->used = builder->clock;
+	*ucname = victim->ucname;
+	return victim->ucname_len;
+}
+
+
+/**
+	Release the buffers of a builder but not the builder itself.
+ */
+static void builder_clear(obexftp_builder_t *builder)
+{
+	int i;
+
+	for (i = 0; i < OBEXFTP_NAME_CACHE_SIZE; i++) {
+		free(builder->names[i].name);
+		free(builder->names[i].ucname);
+	}
+	free(builder->scratch);
+	memset(builder, 0, sizeof(*builder));
+}
+
+
+/**
+	Add the connection id header if a connection id is in use.
+ */
+static void add_connection_header(obex_t obex, obex_object_t *object, uint32_t conn)
+{
+	obex_headerdata_t hv;
+
+        if(conn != 0xffffffff) {
+		hv.bq4 = conn;
+		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
+	}
+}
+
+
+/**
+	Create a request builder.
+
+	A builder keeps scratch buffers and the encodings of recently used
+	names so that building requests does no heap allocations once warm.
+
+	\return a new builder, NULL on error
+ */
+obexftp_builder_t *obexftp_builder_new(void)
+{
+	return calloc(1, sizeof(obexftp_builder_t));
+}
+
+
+/**
+	Free a request builder.
+
+	\param builder a builder from obexftp_builder_new(), may be NULL
+ */
+void obexftp_builder_free(obexftp_builder_t *builder)
+{
+	if (builder == NULL)
+		return;
+	builder_clear(builder);
+	free(builder);
+}
+
+
 /**
 	Build an INFO request object (Siemens only).
 
@@ -46,15 +163,12 @@ obex_object_t *obexftp_build_info (obex_t obex, uint32_t conn, uint8_t opcode)
         if(object == NULL)
                 return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
- 
+	add_connection_header(obex, object, conn);
+
         cmdstr[2] = opcode;
 	hv.bs = (const uint8_t *) cmdstr;
 	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_APPARAM, hv, sizeof(cmdstr), OBEX_FL_FIT_ONE_PACKET);
- 
+
 	return object;
 }
 
@@ -62,6 +176,7 @@ obex_object_t *obexftp_build_info (obex_t obex, uint32_t conn, uint8_t opcode)
 /**
 	Build a GET request object.
 
+	\param builder request builder from obexftp_builder_new()
 	\param obex reference to an OpenOBEX instance.
 	\param conn optional connection id number
 	\param name name of the requested file
@@ -70,43 +185,36 @@ obex_object_t *obexftp_build_info (obex_t obex, uint32_t conn, uint8_t opcode)
 
 	\note \a name and \a type musn't both be NULL
  */
-obex_object_t *obexftp_build_get (obex_t obex, uint32_t conn, const char *name, const char *type)
+obex_object_t *obexftp_builder_get (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, const char *type)
 {
 	obex_object_t *object;
 	obex_headerdata_t hv;
-        uint8_t *ucname;
+        const uint8_t *ucname;
         int ucname_len;
 
         object = OBEX_ObjectNew(obex, OBEX_CMD_GET);
         if(object == NULL)
                 return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
- 
+	add_connection_header(obex, object, conn);
+
         if(type != NULL) {
 		// type header is a null terminated ascii string
 		hv.bs = (const uint8_t *) type;
 		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_TYPE, hv, strlen(type)+1, OBEX_FL_FIT_ONE_PACKET);
-	}	
- 
+	}
+
 	if (name != NULL) {
-		ucname_len = strlen(name)*2 + 2;
-		ucname = malloc(ucname_len);
-		if(ucname == NULL) {
+		ucname_len = builder_encode_name(builder, name, &ucname);
+		if(ucname_len < 0) {
 	                (void) OBEX_ObjectDelete(obex, object);
 		        return NULL;
 		}
 
-		ucname_len = CharToUnicode(ucname, (uint8_t*)name, ucname_len);
-
-		hv.bs = (const uint8_t *) ucname;
+		hv.bs = ucname;
 		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, OBEX_FL_FIT_ONE_PACKET);
-		free(ucname);
 	}
-	
+
 	return object;
 }
 
@@ -114,6 +222,7 @@ obex_object_t *obexftp_build_get (obex_t obex, uint32_t conn, const char *name,
 /**
 	Build a RENAME request object (Siemens only).
 
+	\param builder request builder from obexftp_builder_new()
 	\param obex reference to an OpenOBEX instance.
 	\param conn optional connection id number
 	\param from original name of the requested file
@@ -122,7 +231,7 @@ obex_object_t *obexftp_build_get (obex_t obex, uint32_t conn, const char *name,
 
 	\note neither filename may be NULL
  */
-obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *from, const char *to)
+obex_object_t *obexftp_builder_rename (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to)
 {
 	obex_object_t *object;
 	obex_headerdata_t hv;
@@ -139,19 +248,16 @@ obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *fro
         if(object == NULL)
                 return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
+	add_connection_header(obex, object, conn);
 
         appstr_len = 1 + 1 + sizeof(opname) +
 		strlen(from)*2 + 2 +
 		strlen(to)*2 + 2 + 2;
-        appstr = malloc(appstr_len);
-        if(appstr == NULL) {
+        if(grow_buffer((void **)&builder->scratch, &builder->scratch_size, appstr_len) < 0) {
                	(void) OBEX_ObjectDelete(obex, object);
 	        return NULL;
 	}
+        appstr = builder->scratch;
 
 	appstr_p = appstr;
 	*appstr_p++ = 0x34;
@@ -167,11 +273,10 @@ obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *fro
 	*appstr_p++ = 0x36;
         ucname_len = CharToUnicode(appstr_p + 1, (uint8_t*)to, strlen(to)*2 + 2);
 	*appstr_p = ucname_len - 2; /* no trailing 0 */
-	
+
         hv.bs = (const uint8_t *) appstr;
         (void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_APPARAM, hv, appstr_len - 2, 0);
-        free(appstr);
-	
+
 	return object;
 }
 
@@ -179,6 +284,7 @@ obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *fro
 /**
 	Build a DELETE request object.
 
+	\param builder request builder from obexftp_builder_new()
 	\param obex reference to an OpenOBEX instance.
 	\param conn optional connection id number
 	\param name name of the file to be deleted
@@ -186,11 +292,11 @@ obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *fro
 
 	\note \a name may not be NULL
  */
-obex_object_t *obexftp_build_del (obex_t obex, uint32_t conn, const char *name)
+obex_object_t *obexftp_builder_del (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name)
 {
 	obex_object_t *object;
 	obex_headerdata_t hv;
-        uint8_t *ucname;
+        const uint8_t *ucname;
         int ucname_len;
 
         if(name == NULL)
@@ -200,24 +306,17 @@ obex_object_t *obexftp_build_del (obex_t obex, uint32_t conn, const char *name)
         if(object == NULL)
                 return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
+	add_connection_header(obex, object, conn);
 
-        ucname_len = strlen(name)*2 + 2;
-        ucname = malloc(ucname_len);
-        if(ucname == NULL) {
+        ucname_len = builder_encode_name(builder, name, &ucname);
+        if(ucname_len < 0) {
                	(void) OBEX_ObjectDelete(obex, object);
 	        return NULL;
 	}
 
-        ucname_len = CharToUnicode(ucname, (uint8_t*)name, ucname_len);
-
-        hv.bs = (const uint8_t *) ucname;
+        hv.bs = ucname;
         (void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, OBEX_FL_FIT_ONE_PACKET);
-        free(ucname);
-	
+
 	return object;
 }
 
@@ -225,55 +324,50 @@ obex_object_t *obexftp_build_del (obex_t obex, uint32_t conn, const char *name)
 /**
 	Build a SETPATH request object.
 
+	\param builder request builder from obexftp_builder_new()
 	\param obex reference to an OpenOBEX instance.
 	\param conn optional connection id number
 	\param name name of the file to be deleted
 	\param create create the folder if neccessary
 	\return a new obex object if successful, NULL otherwise
 
-	\note 
-	 if \a name is NULL ascend one directory 
+	\note
+	 if \a name is NULL ascend one directory
 	 if \a name is empty change to top/default directory
  */
-obex_object_t *obexftp_build_setpath (obex_t obex, uint32_t conn, const char *name, int create)
+obex_object_t *obexftp_builder_setpath (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, int create)
 {
 	obex_object_t *object;
 	obex_headerdata_t hv;
 	// "Backup Level" and "Don't Create" flag in first byte
 	// second byte is reserved and needs to be 0
 	uint8_t setpath_nohdr_data[2] = {0, 0};
-        uint8_t *ucname;
+        const uint8_t *ucname;
 	int ucname_len;
 
 	object = OBEX_ObjectNew(obex, OBEX_CMD_SETPATH);
 	if(object == NULL)
 		return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
+	add_connection_header(obex, object, conn);
 
 	if (create == 0) {
 		// set the 'Don't Create' bit
 		setpath_nohdr_data[0] |= 2;
 	}
 	if (name) {
-		ucname_len = strlen(name)*2 + 2;
-		ucname = malloc(ucname_len);
-		if (ucname == NULL) {
+		ucname_len = builder_encode_name(builder, name, &ucname);
+		if (ucname_len < 0) {
 			(void) OBEX_ObjectDelete(obex, object);
 			return NULL;
 		}
-		ucname_len = CharToUnicode(ucname, (uint8_t*)name, ucname_len);
 
 		/* apparently the empty name header is meant to be really empty... */
 		if (ucname_len == 2)
 			ucname_len = 0;
 
-        	hv.bs = (const uint8_t *) ucname;
+        	hv.bs = ucname;
 		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, 0);
-		free(ucname);
 	}
 	else {
 		setpath_nohdr_data[0] = 1; /* or |= perhaps? */
@@ -288,6 +382,7 @@ obex_object_t *obexftp_build_setpath (obex_t obex, uint32_t conn, const char *na
 /**
 	Build a PUT request object.
 
+	\param builder request builder from obexftp_builder_new()
 	\param obex reference to an OpenOBEX instance.
 	\param conn optional connection id number
 	\param name name of the target file
@@ -296,34 +391,27 @@ obex_object_t *obexftp_build_setpath (obex_t obex, uint32_t conn, const char *na
 
 	\note use build_object_from_file() instead
  */
-obex_object_t *obexftp_build_put (obex_t obex, uint32_t conn, const char *name, const int size)
+obex_object_t *obexftp_builder_put (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, const int size)
 {
 	obex_object_t *object;
 	obex_headerdata_t hv;
-	uint8_t *ucname;
+	const uint8_t *ucname;
 	int ucname_len;
-		
+
 	object = OBEX_ObjectNew(obex, OBEX_CMD_PUT);
 	if(object == NULL)
 		return NULL;
 
-        if(conn != 0xffffffff) {
-		hv.bq4 = conn;
-		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_CONNECTION, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
-	}
+	add_connection_header(obex, object, conn);
 
-	ucname_len = strlen(name)*2 + 2;
-	ucname = malloc(ucname_len);
-	if(ucname == NULL) {
+	ucname_len = builder_encode_name(builder, name, &ucname);
+	if(ucname_len < 0) {
        		(void) OBEX_ObjectDelete(obex, object);
 		return NULL;
 	}
 
-	ucname_len = CharToUnicode(ucname, (uint8_t*)name, ucname_len);
-
-       	hv.bs = (const uint8_t *) ucname;
+       	hv.bs = ucname;
 	(void ) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, 0);
-	free(ucname);
 
 	hv.bq4 = (uint32_t) size;
 	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_LENGTH, hv, sizeof(uint32_t), 0);
@@ -333,3 +421,250 @@ obex_object_t *obexftp_build_put (obex_t obex, uint32_t conn, const char *name,
 
 	return object;
 }
+
+
+/**
+	Build an ACTION request object (OBEX 1.5).
+
+	\param builder request builder from obexftp_builder_new()
+	\param obex reference to an OpenOBEX instance.
+	\param conn optional connection id number
+	\param action one of the OBEXFTP_ACTION_ identifiers
+	\param name name of the file acted on
+	\param dest destination name, NULL for none
+	\param perms permissions, used with OBEXFTP_ACTION_SETPERM only
+	\return a new obex object if successful, NULL otherwise
+ */
+static obex_object_t *builder_action (obexftp_builder_t *builder, obex_t obex, uint32_t conn, uint8_t action, const char *name, const char *dest, uint32_t perms)
+{
+	obex_object_t *object;
+	obex_headerdata_t hv;
+	const uint8_t *ucname;
+	int ucname_len;
+
+	if(name == NULL)
+		return NULL;
+
+	object = OBEX_ObjectNew(obex, OBEX_CMD_ACTION);
+	if(object == NULL)
+		return NULL;
+
+	add_connection_header(obex, object, conn);
+
+	hv.bq1 = action;
+	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_ACTION_ID, hv, 1, OBEX_FL_FIT_ONE_PACKET);
+
+	ucname_len = builder_encode_name(builder, name, &ucname);
+	if(ucname_len < 0) {
+		(void) OBEX_ObjectDelete(obex, object);
+		return NULL;
+	}
+	hv.bs = ucname;
+	(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_NAME, hv, ucname_len, OBEX_FL_FIT_ONE_PACKET);
+
+	if(dest != NULL) {
+		ucname_len = builder_encode_name(builder, dest, &ucname);
+		if(ucname_len < 0) {
+			(void) OBEX_ObjectDelete(obex, object);
+			return NULL;
+		}
+		hv.bs = ucname;
+		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_DESTNAME, hv, ucname_len, OBEX_FL_FIT_ONE_PACKET);
+	}
+
+	if(action == OBEXFTP_ACTION_SETPERM) {
+		hv.bq4 = perms;
+		(void) OBEX_ObjectAddHeader(obex, object, OBEX_HDR_PERMISSIONS, hv, sizeof(uint32_t), OBEX_FL_FIT_ONE_PACKET);
+	}
+
+	return object;
+}
+
+
+/**
+	Build a COPY request object, the server copies the file.
+
+	\param builder request builder from obexftp_builder_new()
+	\param obex reference to an OpenOBEX instance.
+	\param conn optional connection id number
+	\param from name of the file to copy
+	\param to name of the copy
+	\return a new obex object if successful, NULL otherwise
+
+	\note neither filename may be NULL
+ */
+obex_object_t *obexftp_builder_copy (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to)
+{
+	if(to == NULL)
+		return NULL;
+	return builder_action(builder, obex, conn, OBEXFTP_ACTION_COPY, from, to, 0);
+}
+
+
+/**
+	Build a MOVE request object, the server moves or renames the
+	file or folder.
+
+	\param builder request builder from obexftp_builder_new()
+	\param obex reference to an OpenOBEX instance.
+	\param conn optional connection id number
+	\param from original name of the file or folder
+	\param to new name of the file or folder
+	\return a new obex object if successful, NULL otherwise
+
+	\note neither filename may be NULL
+ */
+obex_object_t *obexftp_builder_move (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to)
+{
+	if(to == NULL)
+		return NULL;
+	return builder_action(builder, obex, conn, OBEXFTP_ACTION_MOVE, from, to, 0);
+}
+
+
+/**
+	Build a SET PERMISSIONS request object.
+
+	\param builder request builder from obexftp_builder_new()
+	\param obex reference to an OpenOBEX instance.
+	\param conn optional connection id number
+	\param name name of the file or folder
+	\param perms OBEXFTP_PERM_ bits for user, group and other
+	\return a new obex object if successful, NULL otherwise
+
+	\note \a name may not be NULL
+ */
+obex_object_t *obexftp_builder_setperm (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, uint32_t perms)
+{
+	return builder_action(builder, obex, conn, OBEXFTP_ACTION_SETPERM, name, NULL, perms);
+}
+
+
+/* one-shot variants, without a builder to keep */
+
+/**
+	Build a GET request object.
+	\see obexftp_builder_get()
+ */
+obex_object_t *obexftp_build_get (obex_t obex, uint32_t conn, const char *name, const char *type)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_get(&builder, obex, conn, name, type);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a RENAME request object (Siemens only).
+	\see obexftp_builder_rename()
+ */
+obex_object_t *obexftp_build_rename (obex_t obex, uint32_t conn, const char *from, const char *to)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_rename(&builder, obex, conn, from, to);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a DELETE request object.
+	\see obexftp_builder_del()
+ */
+obex_object_t *obexftp_build_del (obex_t obex, uint32_t conn, const char *name)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_del(&builder, obex, conn, name);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a SETPATH request object.
+	\see obexftp_builder_setpath()
+ */
+obex_object_t *obexftp_build_setpath (obex_t obex, uint32_t conn, const char *name, int create)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_setpath(&builder, obex, conn, name, create);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a PUT request object.
+	\see obexftp_builder_put()
+ */
+obex_object_t *obexftp_build_put (obex_t obex, uint32_t conn, const char *name, const int size)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_put(&builder, obex, conn, name, size);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a COPY request object.
+	\see obexftp_builder_copy()
+ */
+obex_object_t *obexftp_build_copy (obex_t obex, uint32_t conn, const char *from, const char *to)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_copy(&builder, obex, conn, from, to);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a MOVE request object.
+	\see obexftp_builder_move()
+ */
+obex_object_t *obexftp_build_move (obex_t obex, uint32_t conn, const char *from, const char *to)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_move(&builder, obex, conn, from, to);
+	builder_clear(&builder);
+	return object;
+}
+
+
+/**
+	Build a SET PERMISSIONS request object.
+	\see obexftp_builder_setperm()
+ */
+obex_object_t *obexftp_build_setperm (obex_t obex, uint32_t conn, const char *name, uint32_t perms)
+{
+	obexftp_builder_t builder;
+	obex_object_t *object;
+
+	memset(&builder, 0, sizeof(builder));
+	object = obexftp_builder_setperm(&builder, obex, conn, name, perms);
+	builder_clear(&builder);
+	return object;
+}
@@ -43,6 +43,56 @@ extern "C" {
  * parameter 0x01: mem installed, 0x02: free mem */
 #define APPARAM_INFO_CODE '2'
 
+/** OBEX 1.5 ACTION operation, defined by OpenOBEX 1.5 and later. */
+#ifndef OBEX_CMD_ACTION
+#define OBEX_CMD_ACTION 0x06
+#endif
+#ifndef OBEX_HDR_DESTNAME
+#define OBEX_HDR_DESTNAME 0x15
+#endif
+#ifndef OBEX_HDR_ACTION_ID
+#define OBEX_HDR_ACTION_ID 0x94
+#endif
+#ifndef OBEX_HDR_PERMISSIONS
+#define OBEX_HDR_PERMISSIONS 0xd6
+#endif
+
+/** Action identifiers of an ACTION request. */
+#define OBEXFTP_ACTION_COPY 0x00
+#define OBEXFTP_ACTION_MOVE 0x01
+#define OBEXFTP_ACTION_SETPERM 0x02
+
+/** Permission bits of an ACTION request, one byte each for user,
+ * group and other, e.g. OBEXFTP_PERM_USER(OBEXFTP_PERM_READ). */
+#define OBEXFTP_PERM_READ 0x01
+#define OBEXFTP_PERM_WRITE 0x02
+#define OBEXFTP_PERM_DELETE 0x04
+#define OBEXFTP_PERM_MODIFY 0x80
+#define OBEXFTP_PERM_USER(p) ((uint32_t)(p) << 16)
+#define OBEXFTP_PERM_GROUP(p) ((uint32_t)(p) << 8)
+#define OBEXFTP_PERM_OTHER(p) ((uint32_t)(p))
+
+/** Number of encoded names a request builder keeps. */
+#define OBEXFTP_NAME_CACHE_SIZE 16
+
+/** An encoded NAME header, keyed by the name it was built from. */
+typedef struct {
+	char *name;		/* as passed in */
+	int name_size;		/* allocated */
+	uint8_t *ucname;	/* UTF-16BE */
+	int ucname_size;	/* allocated */
+	int ucname_len;		/* encoded, including the trailing 0 */
+	unsigned int used;	/* last use, for replacement */
+} obexftp_name_cache_t;
+
+/** Reusable buffers for building requests, one per client. */
+typedef struct {
+	obexftp_name_cache_t names[OBEXFTP_NAME_CACHE_SIZE];
+	unsigned int clock;
+	uint8_t *scratch;	/* app. params and the like */
+	int scratch_size;	/* allocated */
+} obexftp_builder_t;
+
 
 /*@null@*/ obex_object_t *obexftp_build_info (obex_t obex, uint32_t conn, uint8_t opcode);
 /*@null@*/ obex_object_t *obexftp_build_get (obex_t obex, uint32_t conn, const char *name, const char *type);
@@ -50,6 +100,21 @@ extern "C" {
 /*@null@*/ obex_object_t *obexftp_build_del (obex_t obex, uint32_t conn, const char *name);
 /*@null@*/ obex_object_t *obexftp_build_setpath (obex_t obex, uint32_t conn, const char *name, int create);
 /*@null@*/ obex_object_t *obexftp_build_put (obex_t obex, uint32_t conn, const char *name, int size);
+/*@null@*/ obex_object_t *obexftp_build_copy (obex_t obex, uint32_t conn, const char *from, const char *to);
+/*@null@*/ obex_object_t *obexftp_build_move (obex_t obex, uint32_t conn, const char *from, const char *to);
+/*@null@*/ obex_object_t *obexftp_build_setperm (obex_t obex, uint32_t conn, const char *name, uint32_t perms);
+
+/*@null@*/ obexftp_builder_t *obexftp_builder_new (void);
+void obexftp_builder_free (/*@only@*/ /*@null@*/ obexftp_builder_t *builder);
+
+/*@null@*/ obex_object_t *obexftp_builder_get (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, const char *type);
+/*@null@*/ obex_object_t *obexftp_builder_rename (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to);
+/*@null@*/ obex_object_t *obexftp_builder_del (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name);
+/*@null@*/ obex_object_t *obexftp_builder_setpath (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, int create);
+/*@null@*/ obex_object_t *obexftp_builder_put (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, int size);
+/*@null@*/ obex_object_t *obexftp_builder_copy (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to);
+/*@null@*/ obex_object_t *obexftp_builder_move (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *from, const char *to);
+/*@null@*/ obex_object_t *obexftp_builder_setperm (obexftp_builder_t *builder, obex_t obex, uint32_t conn, const char *name, uint32_t perms);
 
 #ifdef __cplusplus
 }
@@ -39,19 +39,407 @@
 #else
 #define locale_charset ""
 #endif /* HAVE_LANGINFO_H */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 #endif /* HAVE_ICONV */
 #endif /* _WIN32 */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
 #include "unicode.h"
 
 #include <common.h>
 
 
+#if !defined(_WIN32) && defined(HAVE_ICONV)
+
+/* the conversions we keep open descriptors for */
+enum {
+	CONV_LOCALE_TO_UTF16,
+	CONV_LATIN1_TO_UTF16,
+	CONV_UTF16_TO_LOCALE,
+	CONV_UTF8_TO_LOCALE,
+	CONV_LOCALE_TO_UTF8,
+	CONV_MAX
+};
+
+/* NULL stands for the locale charset */
+static const char *conv_tocode[CONV_MAX] = {
+	"UTF-16BE", "UTF-16BE", NULL, NULL, "UTF-8"
+};
+static const char *conv_fromcode[CONV_MAX] = {
+	NULL, "ISO-8859-1", "UTF-16BE", "UTF-8", NULL
+};
+
+/* resolved once, setlocale() isn't thread-safe */
+static char locale_codeset[64];
+static int locale_is_utf8 = 0;
+
+static void locale_init(void)
+{
+	setlocale(LC_CTYPE, "");
+	strncpy(locale_codeset, locale_charset, sizeof(locale_codeset) - 1);
+	locale_codeset[sizeof(locale_codeset) - 1] = '\0';
+	locale_is_utf8 = !strcasecmp(locale_codeset, "UTF-8") ||
+			 !strcasecmp(locale_codeset, "UTF8");
+	DEBUG(2, "Iconv locale is \"%s\"\n", locale_codeset);
+}
+
+static void conv_cache_free(void *data)
+{
+	iconv_t *cache = data;
+	int i;
+
+	for (i = 0; i < CONV_MAX; i++)
+		if (cache[i] != (iconv_t)(-1))
+			(void) iconv_close(cache[i]);
+	free(cache);
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t locale_once = PTHREAD_ONCE_INIT;
+static pthread_once_t conv_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t conv_key;
+
+static void conv_key_init(void)
+{
+	(void) pthread_key_create(&conv_key, conv_cache_free);
+}
+#else
+static int locale_once = 0;
+static iconv_t *conv_cache = NULL;
+#endif /* HAVE_PTHREAD_H */
+
+/**
+	Resolve the locale charset on first use.
+ */
+static void locale_get(void)
+{
+#ifdef HAVE_PTHREAD_H
+	(void) pthread_once(&locale_once, locale_init);
+#else
+	if (!locale_once) {
+		locale_init();
+		locale_once = 1;
+	}
+#endif /* HAVE_PTHREAD_H */
+}
+
+/**
+	Get the current threads open descriptors, allocate them if needed.
+ */
+static iconv_t *conv_cache_get(void)
+{
+	iconv_t *cache;
+	int i;
+
+	locale_get();
+#ifdef HAVE_PTHREAD_H
+	(void) pthread_once(&conv_key_once, conv_key_init);
+	cache = pthread_getspecific(conv_key);
+#else
+	cache = conv_cache;
+#endif /* HAVE_PTHREAD_H */
+	if (cache)
+		return cache;
+
+	cache = malloc(CONV_MAX * sizeof(iconv_t));
+	if (cache == NULL)
+		return NULL;
+	for (i = 0; i < CONV_MAX; i++)
+		cache[i] = (iconv_t)(-1);
+#ifdef HAVE_PTHREAD_H
+	(void) pthread_setspecific(conv_key, cache);
+#else
+	conv_cache = cache;
+#endif /* HAVE_PTHREAD_H */
+	return cache;
+}
+
+/**
+	Get an open and reset iconv descriptor for a conversion.
+
+	Descriptors are opened once per thread and kept until the thread exits.
+	\return a usable descriptor or (iconv_t)(-1) if the conversion is unsupported
+ */
+static iconv_t conv_get(int conv)
+{
+	iconv_t *cache;
+	const char *tocode, *fromcode;
+
+	cache = conv_cache_get();
+	if (cache == NULL)
+		return (iconv_t)(-1);
+
+	if (cache[conv] == (iconv_t)(-1)) {
+		tocode = conv_tocode[conv] ? conv_tocode[conv] : locale_codeset;
+		fromcode = conv_fromcode[conv] ? conv_fromcode[conv] : locale_codeset;
+		cache[conv] = iconv_open(tocode, fromcode);
+		if (cache[conv] == (iconv_t)(-1))
+			DEBUG(1, "Iconv can't convert from \"%s\" to \"%s\"\n", fromcode, tocode);
+	} else {
+		/* back to the initial shift state, the last use may have failed */
+		(void) iconv(cache[conv], NULL, NULL, NULL, NULL);
+	}
+
+	return cache[conv];
+}
+
+/**
+	Run one conversion on a cached descriptor.
+	\param left set to the number of bytes left in the output buffer
+	\return 0 on success, -1 on (possibly partial) conversion error
+ */
+static int conv_run(int conv, const uint8_t *in, size_t in_len, uint8_t *out, int size, int *left)
+{
+	iconv_t cd;
+	size_t ni, no, nrc;
+	/* avoid type-punned dereferecing (breaks strict aliasing) */
+	char *cc = (char *) in;
+	char *ucc = (char *) out;
+
+	*left = size;
+	cd = conv_get(conv);
+	if (cd == (iconv_t)(-1))
+		return -1;
+
+	ni = in_len;
+	no = size;
+	nrc = iconv(cd, &cc, &ni, &ucc, &no);
+	*left = no;
+	if (nrc == (size_t)(-1)) {
+		DEBUG(3, "Iconv conversion %d error: '%s'\n", conv, cc);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/* built-in UTF-8 <-> UTF-16BE, iconv is only needed for other charsets */
+
+/**
+	Widen ASCII to UTF-16BE.
+	\return the number of bytes consumed, stops at the first non-ASCII byte
+ */
+static int ascii_to_utf16be(uint8_t *uc, const uint8_t *c, int len)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(c + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		/* interleaving a zero high byte gives big-endian code units */
+		_mm_storeu_si128((__m128i *)(uc + 2*i), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i *)(uc + 2*i + 16), _mm_unpackhi_epi8(zero, v));
+	}
+#endif /* __SSE2__ */
+	for (; i < len && c[i] < 0x80; i++) {
+		uc[2*i] = 0;
+		uc[2*i+1] = c[i];
+	}
+	return i;
+}
+
+/**
+	Narrow UTF-16BE code units below 0x80 to ASCII.
+	\return the number of code units consumed, stops at the first non-ASCII unit
+ */
+static int utf16be_to_ascii(uint8_t *c, const uint8_t *uc, int units)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16((short)0x80ff); /* 0xff 0x80 in memory */
+	__m128i lo, hi;
+
+	for (; i + 16 <= units; i += 16) {
+		lo = _mm_loadu_si128((const __m128i *)(uc + 2*i));
+		hi = _mm_loadu_si128((const __m128i *)(uc + 2*i + 16));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_or_si128(lo, hi), mask), _mm_setzero_si128())) != 0xffff)
+			break;
+		/* read as little-endian words the ASCII byte is on top */
+		_mm_storeu_si128((__m128i *)(c + i),
+			_mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif /* __SSE2__ */
+	for (; i < units && uc[2*i] == 0 && uc[2*i+1] < 0x80; i++)
+		c[i] = uc[2*i+1];
+	return i;
+}
+
+/**
+	Decode one UTF-8 sequence like iconv would.
+
+	Overlong forms, surrogates and code points above U+10FFFF are rejected.
+	\return the length of the sequence, -1 on invalid or truncated input
+ */
+static int utf8_decode(const uint8_t *c, int len, uint32_t *cp)
+{
+	static const uint32_t min_cp[4] = { 0, 0x80, 0x800, 0x10000 };
+	int i, n;
+
+	if (c[0] < 0x80) {
+		*cp = c[0];
+		return 1;
+	} else if (c[0] >= 0xc2 && c[0] <= 0xdf) {
+		*cp = c[0] & 0x1f;
+		n = 1;
+	} else if (c[0] >= 0xe0 && c[0] <= 0xef) {
+		*cp = c[0] & 0x0f;
+		n = 2;
+	} else if (c[0] >= 0xf0 && c[0] <= 0xf4) {
+		*cp = c[0] & 0x07;
+		n = 3;
+	} else
+		return -1;
+
+	if (n >= len)
+		return -1;
+	for (i = 1; i <= n; i++) {
+		if ((c[i] & 0xc0) != 0x80)
+			return -1;
+		*cp = (*cp << 6) | (c[i] & 0x3f);
+	}
+	if (*cp < min_cp[n] || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff))
+		return -1;
+	return n + 1;
+}
+
+/**
+	Convert UTF-8 to UTF-16BE.
+	\return the number of bytes written, -1 on invalid input or short buffer
+ */
+static int utf8_to_utf16be(uint8_t *uc, const uint8_t *c, int len, int size)
+{
+	int i = 0, o = 0, n;
+	uint32_t cp;
+
+	while (i < len) {
+		/* ASCII runs, two bytes each */
+		n = ascii_to_utf16be(uc + o, c + i, (size - o) / 2 < len - i ? (size - o) / 2 : len - i);
+		i += n;
+		o += 2*n;
+		if (i >= len)
+			break;
+
+		n = utf8_decode(c + i, len - i, &cp);
+		if (n < 0)
+			return -1;
+		i += n;
+
+		if (cp >= 0x10000) {
+			if (o + 4 > size)
+				return -1;
+			cp -= 0x10000;
+			uc[o++] = 0xd8 | (cp >> 18);
+			uc[o++] = (cp >> 10) & 0xff;
+			uc[o++] = 0xdc | ((cp >> 8) & 0x03);
+			uc[o++] = cp & 0xff;
+		} else {
+			if (o + 2 > size)
+				return -1;
+			uc[o++] = cp >> 8;
+			uc[o++] = cp & 0xff;
+		}
+	}
+	return o;
+}
+
+/**
+	Convert UTF-16BE to UTF-8.
+	\return the number of bytes written, -1 on unpaired surrogates or short buffer
+ */
+static int utf16be_to_utf8(uint8_t *c, const uint8_t *uc, int len, int size)
+{
+	int i = 0, o = 0, n;
+	uint32_t cp, lo;
+
+	len /= 2; /* in code units */
+	while (i < len) {
+		n = utf16be_to_ascii(c + o, uc + 2*i, size - o < len - i ? size - o : len - i);
+		i += n;
+		o += n;
+		if (i >= len)
+			break;
+
+		cp = (uc[2*i] << 8) | uc[2*i+1];
+		i++;
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			if (i >= len)
+				return -1;
+			lo = (uc[2*i] << 8) | uc[2*i+1];
+			if (lo < 0xdc00 || lo > 0xdfff)
+				return -1;
+			i++;
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+		} else if (cp >= 0xdc00 && cp <= 0xdfff)
+			return -1;
+
+		if (cp < 0x80) {
+			if (o + 1 > size)
+				return -1;
+			c[o++] = cp;
+		} else if (cp < 0x800) {
+			if (o + 2 > size)
+				return -1;
+			c[o++] = 0xc0 | (cp >> 6);
+			c[o++] = 0x80 | (cp & 0x3f);
+		} else if (cp < 0x10000) {
+			if (o + 3 > size)
+				return -1;
+			c[o++] = 0xe0 | (cp >> 12);
+			c[o++] = 0x80 | ((cp >> 6) & 0x3f);
+			c[o++] = 0x80 | (cp & 0x3f);
+		} else {
+			if (o + 4 > size)
+				return -1;
+			c[o++] = 0xf0 | (cp >> 18);
+			c[o++] = 0x80 | ((cp >> 12) & 0x3f);
+			c[o++] = 0x80 | ((cp >> 6) & 0x3f);
+			c[o++] = 0x80 | (cp & 0x3f);
+		}
+	}
+	return o;
+}
+
+/**
+	Check that a string is valid UTF-8.
+	\return TRUE if iconv would accept it
+ */
+static int utf8_valid(const uint8_t *c, int len)
+{
+	int i = 0, n;
+	uint32_t cp;
+
+	while (i < len) {
+		if (c[i] < 0x80) {
+			i++;
+			continue;
+		}
+		n = utf8_decode(c + i, len - i, &cp);
+		if (n < 0)
+			return FALSE;
+		i += n;
+	}
+	return TRUE;
+}
+
+#endif /* !_WIN32 && HAVE_ICONV */
+
+
 /**
 	Convert a string to UTF-16BE, tries to guess charset and encoding.
 
 	As a lib we can't be sure what the input charset and encoding is.
 	Try to read the input as UTF-8, this will also work for plain ASCII (7bit).
+	UTF-8 is converted without iconv, with a vectorized path for ASCII.
 	On errors fall back to the environment locale, which again could be UTF-8.
 	As last resort try to copy verbatim, i.e. as ISO-8859-1.
 
@@ -78,54 +466,28 @@ int CharToUnicode(uint8_t *uc, const uint8_t *c, int size)
 #else /* _WIN32 */
 
 #ifdef HAVE_ICONV
-	iconv_t utf16;
-	size_t ni, no, nrc;
-	int ret;
-	/* avoid type-punned dereferecing (breaks strict aliasing) */
-       	char *cc = c;
-	char *ucc = uc;
+	int ni, no;
 
         return_val_if_fail(uc != NULL, -1);
         return_val_if_fail(c != NULL, -1);
 
+	ni = strlen((const char *) c) + 1;
+
 	/* try UTF-8 to UTF-16BE */
-	ni = strlen(cc) + 1;
-	no = size;
-	utf16 = iconv_open("UTF-16BE", "UTF-8");
-       	nrc = iconv(utf16, &cc, &ni, &ucc, &no);
-       	ret = iconv_close(utf16);
-       	if (nrc == (size_t)(-1)) {
-       		DEBUG(3, "Iconv from UTF-8 conversion error: '%s'\n", cc);
-       	} else {
-		return size-no;
-	}
+	no = utf8_to_utf16be(uc, c, ni, size);
+	if (no >= 0)
+		return no;
+	DEBUG(3, "UTF-8 conversion error\n");
 
 	/* try current locale charset to UTF-16BE */
-	setlocale(LC_CTYPE, "");
-	DEBUG(2, "Iconv from locale \"%s\"\n", locale_charset);
-       	cc = c;
-	ucc = uc;
-	ni = strlen(cc) + 1;
-	no = size;
-	utf16 = iconv_open("UTF-16BE", locale_charset);
-       	nrc = iconv(utf16, &cc, &ni, &ucc, &no);
-       	ret = iconv_close(utf16);
-       	if (nrc == (size_t)(-1)) {
-       		DEBUG(3, "Iconv from locale conversion error: '%s'\n", cc);
-       	} else {
+	DEBUG(2, "Iconv from locale \"%s\"\n", locale_codeset);
+	if (conv_run(CONV_LOCALE_TO_UTF16, c, ni, uc, size, &no) == 0)
 		return size-no;
-	}
+	DEBUG(3, "Iconv from locale conversion error\n");
 
 	/* fallback to ISO-8859-1 to UTF-16BE (every byte is valid here) */
-       	cc = c;
-	ucc = uc;
-	ni = strlen(cc) + 1;
-	no = size;
-	utf16 = iconv_open("UTF-16BE", "ISO-8859-1");
-       	nrc = iconv(utf16, &cc, &ni, &ucc, &no);
-       	ret = iconv_close(utf16);
-       	if (nrc == (size_t)(-1)) {
-       		DEBUG(2, "Iconv internal conversion error: '%s'\n", cc);
+	if (conv_run(CONV_LATIN1_TO_UTF16, c, ni, uc, size, &no) < 0) {
+		DEBUG(2, "Iconv internal conversion error\n");
 		return -1;
 	}
 
@@ -143,6 +505,7 @@ int CharToUnicode(uint8_t *uc, const uint8_t *c, int size)
 
 	Plain ASCII (7bit) and basic ISO-8859-1 will always work.
 	This conversion supports UTF-8 and single byte locales.
+	UTF-8 locales don't need iconv.
 
 	\note This is a quick hack until OpenOBEX is iconv-ready.
  */
@@ -169,28 +532,24 @@ int UnicodeToChar(uint8_t *c, const uint8_t *uc, int size)
 #else /* _WIN32 */
 
 #ifdef HAVE_ICONV
-	iconv_t utf16;
-	size_t ni, no, nrc;
-	int ret;
-	/* avoid type-punned dereferecing (breaks strict aliasing) */
-       	char *cc = c;
-	char *ucc = uc;
+	int ni, no;
 
         return_val_if_fail(uc != NULL, -1);
         return_val_if_fail(c != NULL, -1);
 
 	/* UTF-16BE to current locale charset */
-	setlocale(LC_CTYPE, "");
-	DEBUG(3, "Iconv to locale \"%s\"\n", locale_charset);
-	for (ni=0; ucc[2*ni] != 0 || ucc[2*ni+1] != 0; ni++);
+	for (ni=0; uc[2*ni] != 0 || uc[2*ni+1] != 0; ni++);
 	ni = 2*ni+2;
-	no = size;
-	utf16 = iconv_open(locale_charset, "UTF-16BE");
-       	nrc = iconv(utf16, &ucc, &ni, &cc, &no);
-       	ret = iconv_close(utf16);
-       	if (nrc == (size_t)(-1)) {
-       		DEBUG(2, "Iconv from locale conversion error: '%s'\n", cc);
+	locale_get();
+	if (locale_is_utf8) {
+		no = utf16be_to_utf8(c, uc, ni, size);
+		if (no >= 0)
+			return no;
+		/* let iconv do the partial conversion */
 	}
+	DEBUG(3, "Iconv to locale \"%s\"\n", locale_codeset);
+	if (conv_run(CONV_UTF16_TO_LOCALE, uc, ni, c, size, &no) < 0)
+		DEBUG(2, "Iconv to locale conversion error\n");
 	return size-no;
 #else /* HAVE_ICONV */
 	return OBEX_UnicodeToChar(c, uc, size);
@@ -229,32 +588,87 @@ int Utf8ToChar(uint8_t *c, const uint8_t *uc, int size)
 #else /* _WIN32 */
 
 #ifdef HAVE_ICONV
-	iconv_t utf8;
-	size_t ni, no, nrc;
-	int ret;
-	/* avoid type-punned dereferecing (breaks strict aliasing) */
-       	char *cc = c;
-	char *ucc = uc;
+	int ni, no;
 
         return_val_if_fail(uc != NULL, -1);
         return_val_if_fail(c != NULL, -1);
 
-	setlocale(LC_CTYPE, "");
-	DEBUG(2, "Iconv to \"%s\"\n", locale_charset);
-	ni = strlen(ucc);
-	no = size;
-	utf8 = iconv_open(locale_charset, "UTF-8");
-       	nrc = iconv(utf8, &ucc, &ni, &cc, &no);
-       	ret = iconv_close(utf8);
-       	if (nrc != (size_t)(-1)) {
-       		DEBUG(2, "Iconv from locale conversion error: '%s'\n", cc);
-       	}
+	ni = strlen((const char *) uc);
+	locale_get();
+	if (locale_is_utf8 && ni <= size && utf8_valid(uc, ni)) {
+		memcpy(c, uc, ni);
+		return ni;
+	}
+	DEBUG(2, "Iconv to \"%s\"\n", locale_codeset);
+	if (conv_run(CONV_UTF8_TO_LOCALE, uc, ni, c, size, &no) < 0)
+		DEBUG(2, "Iconv to locale conversion error\n");
+	return size-no;
+#else /* HAVE_ICONV */
+	int n;
+	n = strlen(uc);
+	if (n > size)
+		n = size;
+	memcpy(c, uc, n);
+	return n;
+#endif /* HAVE_ICONV */
+
+#endif /* _WIN32 */
+}
+
+
+/**
+	Convert a string to UTF-8, tries to guess charset like CharToUnicode().
+
+	Input that is valid UTF-8 already is copied, anything else is read
+	in the locale charset. The result is not terminated.
+
+	\return the length of the converted string, -1 on error
+ */
+int CharToUtf8(uint8_t *c, const uint8_t *uc, int size)
+{
+#ifdef _WIN32 /* no need for iconv */
+	int ret, n;
+	uint8_t *wide;
+
+        return_val_if_fail(uc != NULL, -1);
+        return_val_if_fail(c != NULL, -1);
+
+	n = strlen(uc)*2+2;
+	wide = malloc(n);
+	/* ANSI to UTF-16LE */
+	ret = MultiByteToWideChar(CP_ACP, 0, uc, -1, (LPWSTR)wide, n);
+
+	/* UTF-16LE to UTF-8 */
+	ret = WideCharToMultiByte(CP_UTF8, 0, wide, -1, c, size, NULL, NULL);
+	free(wide);
+	return ret > 0 ? ret - 1 : -1; /* without the terminator */
+#else /* _WIN32 */
+
+#ifdef HAVE_ICONV
+	int ni, no;
+
+        return_val_if_fail(uc != NULL, -1);
+        return_val_if_fail(c != NULL, -1);
+
+	ni = strlen((const char *) uc);
+	if (utf8_valid(uc, ni)) {
+		if (ni > size)
+			return -1;
+		memcpy(c, uc, ni);
+		return ni;
+	}
+	DEBUG(2, "Iconv from locale \"%s\"\n", locale_codeset);
+	if (conv_run(CONV_LOCALE_TO_UTF8, uc, ni, c, size, &no) < 0) {
+		DEBUG(2, "Iconv from locale conversion error\n");
+		return -1;
+	}
 	return size-no;
 #else /* HAVE_ICONV */
-	int n, i;
+	int n;
 	n = strlen(uc);
-	strncpy(c, uc, size);
-	c[size] = '\0';
+	if (n > size)
+		return -1;
+	memcpy(c, uc, n);
 	return n;
 #endif /* HAVE_ICONV */
 
@@ -31,6 +31,7 @@ extern "C" {
 int CharToUnicode(uint8_t *uc, const uint8_t *c, int size);
 int UnicodeToChar(uint8_t *c, const uint8_t *uc, int size);
 int Utf8ToChar(uint8_t *c, const uint8_t *uc, int size);
+int CharToUtf8(uint8_t *c, const uint8_t *uc, int size);
 
 #ifdef __cplusplus
 }
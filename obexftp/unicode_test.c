@@ -0,0 +1,205 @@
+/**
+	\file obexftp/unicode_test.c
+	Compare the built-in UTF-8 <-> UTF-16BE converters with iconv.
+	ObexFTP library - language bindings for OBEX file transfer.
+
+	Copyright (c) 2007 Christian W. Zuckschwerdt <zany@triq.net>
+
+	ObexFTP is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation; either version 2 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with ObexFTP. If not, see <http://www.gnu.org/>.
+ */
+
+/* gcc -Wall -I. -I../includes -DHAVE_ICONV -DHAVE_LANGINFO_H -DHAVE_PTHREAD_H -o unicode_test unicode_test.c -lpthread */
+/* add -mno-sse2 to check the plain loops; usage: unicode_test [<iterations>] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the converters are static */
+#include "unicode.c"
+
+static int failed = 0;
+
+/* iconv's idea of the conversion, -1 like the converters on any error */
+static int reference(const char *to, const char *from, const uint8_t *in, int len, uint8_t *out, int size)
+{
+	iconv_t cd;
+	char *ip = (char *) in, *op = (char *) out;
+	size_t ni = len, no = size;
+	size_t ret;
+
+	cd = iconv_open(to, from);
+	if (cd == (iconv_t) -1) {
+		perror("iconv_open");
+		exit(2);
+	}
+	ret = iconv(cd, &ip, &ni, &op, &no);
+	iconv_close(cd);
+	return ret == (size_t) -1 ? -1 : size - (int) no;
+}
+
+static void dump(const char *what, const uint8_t *buf, int len)
+{
+	int i;
+
+	printf("%s:", what);
+	for (i = 0; i < len; i++)
+		printf(" %02x", buf[i]);
+	printf("\n");
+}
+
+/* run one input through both directions, compare with iconv */
+static void check(const uint8_t *in, int len, int size)
+{
+	uint8_t want[2048], got[2048];
+	int r1, r2;
+
+	if (size > (int) sizeof(want))
+		size = sizeof(want);
+
+	r1 = reference("UTF-16BE", "UTF-8", in, len, want, size);
+	r2 = utf8_to_utf16be(got, in, len, size);
+	if (r1 != r2 || (r1 > 0 && memcmp(want, got, r1))) {
+		if (failed++ < 10) {
+			printf("utf8_to_utf16be: iconv %d, got %d, size %d\n", r1, r2, size);
+			dump("  input", in, len);
+		}
+	}
+	if (utf8_valid(in, len) != (reference("UTF-16BE", "UTF-8", in, len, want, sizeof(want)) >= 0)) {
+		if (failed++ < 10) {
+			printf("utf8_valid: disagrees with iconv\n");
+			dump("  input", in, len);
+		}
+	}
+
+	/* and as UTF-16BE back, if it is in the range of UTF-16 at all */
+	if (len % 2 == 0) {
+		r1 = reference("UTF-8", "UTF-16BE", in, len, want, size);
+		r2 = utf16be_to_utf8(got, in, len, size);
+		if (r1 != r2 || (r1 > 0 && memcmp(want, got, r1))) {
+			if (failed++ < 10) {
+				printf("utf16be_to_utf8: iconv %d, got %d, size %d\n", r1, r2, size);
+				dump("  input", in, len);
+			}
+		}
+	}
+}
+
+/* a random mix of ASCII, continuation and lead bytes */
+static int random_input(uint8_t *in, int max)
+{
+	int len = rand() % max;
+	int i, k;
+
+	for (i = 0; i < len; i++) {
+		k = rand() % 10;
+		if (k < 6)
+			in[i] = 1 + rand() % 127;
+		else if (k < 8)
+			in[i] = 0x80 + rand() % 0x40;
+		else
+			in[i] = 0xc0 + rand() % 0x40;
+	}
+	return len;
+}
+
+static int encode(uint8_t *s, uint32_t cp)
+{
+	if (cp < 0x80) {
+		s[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		s[0] = 0xc0 | (cp >> 6);
+		s[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	} else if (cp < 0x10000) {
+		s[0] = 0xe0 | (cp >> 12);
+		s[1] = 0x80 | ((cp >> 6) & 0x3f);
+		s[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	/* also beyond U+10FFFF, up to what four bytes hold */
+	s[0] = 0xf0 | ((cp >> 18) & 0x07);
+	s[1] = 0x80 | ((cp >> 12) & 0x3f);
+	s[2] = 0x80 | ((cp >> 6) & 0x3f);
+	s[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+int main(int argc, char *argv[])
+{
+	/* overlong forms, surrogates, beyond U+10FFFF, truncated sequences */
+	static const char *edge[] = {
+		"\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xf0\x80\x80\x80",
+		"\xf0\x8f\xbf\xbf", "\xed\xa0\x80", "\xed\xbf\xbf", "\xed\xa0\x80\xed\xb0\x80",
+		"\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xf8\x88\x80\x80\x80", "\xfe", "\xff",
+		"\xc2", "\xe2\x82", "\xf0\x9f\x98", "\x80", "\xbf\x80",
+		"\xef\xbf\xbf", "\xf4\x8f\xbf\xbf", "\xf0\x90\x80\x80", "\xc2\x80", "\xdf\xbf",
+		/* as UTF-16BE: lone and swapped surrogates, a valid pair */
+		"\xd8\x00", "\xdc\x00\xd8\x00", "\xd8\x3d\xde\x00", "\xdb\xff\xdf\xff", "\xd8\x00\x00\x41",
+		NULL
+	};
+	uint8_t in[1024], s[8];
+	uint32_t cp;
+	int iterations = 200000;
+	int i, len, pos, size;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+
+	for (i = 0; edge[i] != NULL; i++) {
+		len = strlen(edge[i]);
+		check((const uint8_t *) edge[i], len, 64);
+		/* the same after an ASCII run, to leave the SSE2 loop there */
+		memset(in, 'a', 37);
+		memcpy(in + 37, edge[i], len);
+		check(in, 37 + len, 256);
+	}
+
+	/* every code point, and some beyond */
+	for (cp = 1; cp < 0x140000; cp++) {
+		len = encode(s, cp);
+		check(s, len, 16);
+	}
+
+	/* ASCII runs of every length around the vector width, with a
+	   non-ASCII byte at every position and output buffers cut short */
+	for (len = 0; len <= 80; len++) {
+		for (pos = -1; pos < len; pos++) {
+			memset(in, 'x', len);
+			if (pos >= 0) {
+				in[pos] = 0xc3;
+				if (pos + 1 < len)
+					in[pos + 1] = 0xa4;
+			}
+			for (size = 2 * len - 3; size <= 2 * len + 2; size++)
+				if (size >= 0)
+					check(in, len, size);
+		}
+	}
+
+	srand(1);
+	for (i = 0; i < iterations; i++) {
+		len = random_input(in, 300);
+		size = rand() % 4 == 0 ? rand() % (2 * len + 3) : 2 * len + 2;
+		check(in, len, size);
+	}
+
+	if (failed) {
+		printf("%d mismatches\n", failed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}